@@ -0,0 +1,86 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ */
+
+#include "adaptive_limit.h"
+
+#include <algorithm>
+
+// Fewest completions in an epoch, so the percentiles and throughput mean
+// something. Latency is often bimodal, so with fewer than this, how many slow
+// requests happen to land in an epoch swings both a lot.
+constexpr size_t MIN_EPOCH_COMPLETIONS = 256;
+// How many epochs to stay at the knee before probing past it again, in case
+// things have changed
+constexpr unsigned PROBE_INTERVAL = 64;
+
+AdaptiveLimit::AdaptiveLimit(unsigned max, unsigned start)
+    : max_limit(std::max(max, 1u)),
+      current(std::clamp(start, 1u, max_limit)),
+      lowest(current),
+      highest(current),
+      ceiling(max_limit),
+      slow_start(true),
+      epochs_at_knee(0),
+      epoch_start(0),
+      last_limit(current),
+      last_throughput(0),
+      baseline(0),
+      tail_baseline(0) {}
+
+void AdaptiveLimit::completed(int64_t latency, int64_t now) {
+  if (epoch_start == 0) {
+    epoch_start = now - latency;
+  }
+  latencies.push_back(latency);
+  if (latencies.size() >= std::max<size_t>(current, MIN_EPOCH_COMPLETIONS)) {
+    end_epoch(now);
+  }
+}
+
+void AdaptiveLimit::end_epoch(int64_t now) {
+  auto median = latencies.begin() + latencies.size() / 2;
+  std::nth_element(latencies.begin(), median, latencies.end());
+  int64_t p50 = *median;
+  auto tail = latencies.begin() + latencies.size() * 9 / 10;
+  std::nth_element(median, tail, latencies.end());
+  int64_t p90 = *tail;
+  double throughput =
+      double(latencies.size()) / std::max<int64_t>(now - epoch_start, 1);
+  // With only one in flight nothing of ours can be queued, so that's the
+  // storage's real latency, even if it's got slower overall
+  bool remeasure = baseline == 0 || current == 1;
+  baseline = remeasure ? p50 : std::min(p50, baseline);
+  tail_baseline = remeasure ? p90 : std::min(p90, tail_baseline);
+
+  unsigned limit = current;
+  if (p50 > baseline * 2 || p90 > tail_baseline * 3) {
+    // Requests are queueing in the storage rather than being served in
+    // parallel: back off
+    current = std::max(1u, current * 3 / 4);
+    slow_start = false;
+  } else if (current > last_limit && throughput < last_throughput * 1.02) {
+    // More in flight didn't get any more done, so that's the knee
+    current = last_limit;
+    ceiling = last_limit;
+    slow_start = false;
+    epochs_at_knee = 0;
+  } else if (p50 < baseline * 5 / 4 && current < ceiling) {
+    current = std::min(ceiling, slow_start ? current * 2 : current + 1);
+  }
+  if (ceiling < max_limit && ++epochs_at_knee >= PROBE_INTERVAL) {
+    ceiling = max_limit;
+  }
+  lowest = std::min(lowest, current);
+  highest = std::max(highest, current);
+
+  last_limit = limit;
+  last_throughput = throughput;
+  latencies.clear();
+  epoch_start = now;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ *
+ * - - -
+ *
+ * Adaptive Limit
+ * The best number of operations to keep in flight differs a lot between local
+ * NVMe, spinning disks and network backed volumes. This tunes it as we go,
+ * much as TCP tunes its congestion window. Completions are grouped into
+ * epochs of at least one limit's worth, and at the end of each, the
+ * throughput and median and 90th percentile latencies are compared with what
+ * was seen before:
+ *
+ *  - while latency stays near the lowest seen, the limit grows (doubling at
+ *    first, then by one per epoch)
+ *  - if growing it didn't increase throughput, that's the knee, beyond which
+ *    more in flight only adds latency, so it goes back and stays there (for
+ *    a while, then tries again in case things have changed)
+ *  - if either latency climbs well above the lowest seen for it, the storage
+ *    is queueing requests rather than serving them in parallel, so it's cut
+ *    by a quarter
+ */
+
+#ifndef FSCK_SFS_SRC_ADAPTIVE_LIMIT_H__
+#define FSCK_SFS_SRC_ADAPTIVE_LIMIT_H__
+
+#include <cstdint>
+#include <vector>
+
+// Upper limit on the queue depth, with --queue-depth auto
+constexpr unsigned AUTO_QUEUE_DEPTH_MAX = 256;
+constexpr unsigned AUTO_QUEUE_DEPTH_START = 1;
+
+class AdaptiveLimit {
+ private:
+  const unsigned max_limit;
+  unsigned current;
+  unsigned lowest;
+  unsigned highest;
+  unsigned ceiling;  // the knee, once found
+  bool slow_start;
+  unsigned epochs_at_knee;
+  // Latencies of this epoch's completions, in nanoseconds
+  std::vector<int64_t> latencies;
+  int64_t epoch_start;
+  // The limit and throughput (in completions per nanosecond) of the last
+  // epoch
+  unsigned last_limit;
+  double last_throughput;
+  // Lowest median and 90th percentile latencies seen. Kept apart, as
+  // latency is often bimodal (cached inodes against disk reads), so the tail
+  // can be many times the median even with nothing queued.
+  int64_t baseline;
+  int64_t tail_baseline;
+
+  void end_epoch(int64_t now);
+
+ public:
+  AdaptiveLimit(unsigned max, unsigned start = AUTO_QUEUE_DEPTH_START);
+
+  unsigned limit() const { return current; }
+  // The range the limit has moved over
+  unsigned min_seen() const { return lowest; }
+  unsigned max_seen() const { return highest; }
+  // Records an operation completing at now (on a steady clock, in
+  // nanoseconds) which took latency
+  void completed(int64_t latency, int64_t now);
+};
+
+#endif  // FSCK_SFS_SRC_ADAPTIVE_LIMIT_H__
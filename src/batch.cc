@@ -0,0 +1,126 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ */
+
+#include "batch.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+#include "thread_pool.h"
+
+struct VolumeReport {
+  enum Result { PASSED, FAILED, UNINITIALIZED, ERROR } result = ERROR;
+  std::string error;
+};
+
+std::vector<std::filesystem::path> find_volumes(
+    const std::filesystem::path& dir
+) {
+  std::vector<std::filesystem::path> volumes;
+  for (auto& entry : std::filesystem::directory_iterator{dir}) {
+    if (entry.is_directory() &&
+        std::filesystem::exists(entry.path() / DB_FILENAME)) {
+      volumes.push_back(entry.path());
+    }
+  }
+  std::sort(volumes.begin(), volumes.end());
+  return volumes;
+}
+
+/* Check Volume - Runs every check on one volume, on a worker thread.
+ */
+static VolumeReport check_volume(
+    const std::filesystem::path& path, const Options& options, bool since_auto,
+    bool ignore_uninitialized
+) {
+  VolumeReport report;
+  std::filesystem::path path_database = path / DB_FILENAME;
+  if (!std::filesystem::is_directory(path)) {
+    report.error = "Path not found, or not a directory";
+  } else if (!std::filesystem::exists(path_database)) {
+    if (ignore_uninitialized) {
+      report.result = VolumeReport::UNINITIALIZED;
+    } else {
+      report.error = "Metadata database not found (is this an sfs volume?)";
+    }
+  } else if (!std::filesystem::is_regular_file(path_database)) {
+    report.error = "Metadata database is not a regular file";
+  } else {
+    try {
+      Options volume_options(options);
+      if (since_auto) {
+        volume_options.since = last_clean_time(path);
+        if (volume_options.since == 0) {
+          Log::log(
+              "No record of a clean shutdown or fsck run, checking everything"
+          );
+        }
+      }
+      report.result = run_checks(path, volume_options) ? VolumeReport::PASSED
+                                                       : VolumeReport::FAILED;
+    } catch (std::runtime_error& ex) {
+      report.error = std::string("Runtime error: ") + ex.what();
+    }
+  }
+  if (!report.error.empty()) {
+    std::lock_guard<std::mutex> lock(Log::mutex);
+    std::cerr << Log::prefix << report.error << std::endl;
+  }
+  return report;
+}
+
+bool check_volumes(
+    const std::vector<std::filesystem::path>& volumes, const Options& options,
+    bool since_auto, bool ignore_uninitialized, unsigned jobs
+) {
+  std::vector<VolumeReport> reports(volumes.size());
+  {
+    ThreadPool pool(jobs, volumes.size());
+    Log::log(
+        "Checking " + std::to_string(volumes.size()) + " volumes, " +
+        std::to_string(pool.size()) + " at a time"
+    );
+    for (size_t i = 0; i < volumes.size(); i++) {
+      pool.submit([&, i] {
+        Log::prefix = volumes[i].string() + ": ";
+        reports[i] = check_volume(
+            volumes[i], options, since_auto, ignore_uninitialized
+        );
+        Log::prefix.clear();
+      });
+    }
+    pool.wait();
+  }
+
+  size_t counts[VolumeReport::ERROR + 1] = {};
+  for (const VolumeReport& report : reports) {
+    counts[report.result]++;
+  }
+  Log::log(
+      "Checked " + std::to_string(volumes.size()) + " volumes: " +
+      std::to_string(counts[VolumeReport::PASSED]) + " passed, " +
+      std::to_string(counts[VolumeReport::FAILED]) + " failed, " +
+      std::to_string(counts[VolumeReport::ERROR]) + " could not be checked, " +
+      std::to_string(counts[VolumeReport::UNINITIALIZED]) + " uninitialized"
+  );
+  for (size_t i = 0; i < volumes.size(); i++) {
+    if (reports[i].result == VolumeReport::FAILED) {
+      Log::log("  Failed: " + volumes[i].string());
+    } else if (reports[i].result == VolumeReport::ERROR) {
+      Log::log(
+          "  Error: " + volumes[i].string() + " (" + reports[i].error + ")"
+      );
+    }
+  }
+  return counts[VolumeReport::FAILED] == 0 && counts[VolumeReport::ERROR] == 0;
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ *
+ * - - -
+ *
+ * Batch Mode
+ * A node may host many s3gw volumes. Rather than running fsck.sfs once for
+ * each, they can all be checked by one process, several at a time, in a
+ * single pool of worker threads. Filesystem operations from every volume go
+ * through one IoThrottle, so the queue depth is shared between them rather
+ * than multiplied. Output is prefixed with the volume it relates to, and a
+ * report covering every volume is logged at the end.
+ */
+
+#ifndef FSCK_SFS_SRC_BATCH_H__
+#define FSCK_SFS_SRC_BATCH_H__
+
+#include <filesystem>
+#include <vector>
+
+#include "checks.h"
+
+// Returns every subdirectory of dir which looks like an sfs volume, in order
+std::vector<std::filesystem::path> find_volumes(
+    const std::filesystem::path& dir
+);
+
+// Checks every volume, jobs at a time (0 means one per CPU). If since_auto
+// is set, only data modified since each volume's last clean time is checked.
+// Returns true only if every volume passed.
+bool check_volumes(
+    const std::vector<std::filesystem::path>& volumes, const Options& options,
+    bool since_auto, bool ignore_uninitialized, unsigned jobs
+);
+
+#endif  // FSCK_SFS_SRC_BATCH_H__
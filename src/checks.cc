@@ -9,22 +9,76 @@
 
 #include "checks.h"
 
+#include <sys/stat.h>
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <stdexcept>
 #include <utility>
 #include <vector>
 
+#include "checks/dangling_references.h"
 #include "checks/metadata_integrity.h"
 #include "checks/metadata_schema_version.h"
 #include "checks/object_integrity.h"
 #include "checks/orphaned_metadata.h"
 #include "checks/orphaned_objects.h"
+#include "journal.h"
+#include "plan.h"
+#include "salvage.h"
+#include "trace.h"
 
-void Check::fix() {
+std::shared_ptr<Fix> decode_fix(
+    const std::filesystem::path& root, Decoder& in
+) {
+  switch (in.get_u8()) {
+    case Fix::ORPHANED_OBJECTS:
+      return OrphanedObjectsFix::decode(root, in);
+    case Fix::METADATA_INTEGRITY:
+      return MetadataIntegrityFix::decode(root, in);
+    case Fix::METADATA_SCHEMA_VERSION:
+      return MetadataSchemaVersionFix::decode(root, in);
+    case Fix::ORPHANED_METADATA:
+      return OrphanedMetadataFix::decode(root, in);
+    case Fix::OBJECT_INTEGRITY:
+      return ObjectIntegrityFix::decode(root, in);
+    case Fix::DANGLING_REFERENCE:
+      return DanglingReferenceFix::decode(root, in);
+  }
+  throw std::runtime_error("Unknown fix type in record");
+}
+
+void Check::fix(FixJournal& journal) {
+  // Record everything we're about to do before doing any of it
+  TraceSpan span("fix", check_name);
+  std::vector<uint64_t> ids;
+  journal.fixing(check_name);
+  for (std::shared_ptr<Fix> fix : fixes) {
+    ids.push_back(journal.plan(*fix));
+  }
+  journal.sync();
   for (std::shared_ptr<Fix> fix : fixes) {
     fix->fix();
   }
+  // Fixes may have left their work to be completed in bulk, so they're only
+  // marked done after that. Replaying a fix that had in fact been done is
+  // harmless, as replayed fixes are rechecked first.
+  finish_fixes();
+  for (uint64_t id : ids) {
+    journal.done(id);
+  }
+}
+
+void Check::plan(PlanWriter& plan) {
+  for (std::shared_ptr<Fix> fix : fixes) {
+    plan.add(*fix);
+  }
 }
 
 void Check::show() {
@@ -36,40 +90,373 @@ void Check::show() {
 }
 
 bool Check::check() {
+  TraceSpan span("check", check_name);
   Log::log("Checking " + check_name + "...");
-  return do_check();
+  bool passed = do_check();
+  // Only recorded when verbose
+  for (auto& [query, plan] : metadata->plans) {
+    Log::log_verbose("Query plan for: " + query);
+    for (const std::string& step : plan) {
+      Log::log_verbose("  " + step);
+    }
+  }
+  metadata->plans.clear();
+  return passed;
+}
+
+/* UUID Path - Returns the path of the directory holding an object's versions
+ * (or a multipart upload's parts) relative to the root of the store. The
+ * first/second/fname logic is lifted from sfs's UUIDPath class.
+ */
+std::filesystem::path uuid_path(std::string_view uuid) {
+  std::filesystem::path first = uuid.substr(0, 2);
+  std::filesystem::path second = uuid.substr(2, 2);
+  std::filesystem::path fname = uuid.substr(4);
+  return first / second / fname;
+}
+
+/* Version Path - Returns the path of an object version relative to the root
+ * of the store.
+ */
+std::filesystem::path version_path(std::string_view uuid, std::string_view id) {
+  return uuid_path(uuid) / (std::string(id) + ".v");
+}
+
+/* Version Exists - Whether metadata still has a row for the object version
+ * at obj_path (as returned by version_path()).
+ */
+bool version_exists(Database& metadata, const std::filesystem::path& obj_path) {
+  std::string uuid;
+  for (const auto& part : obj_path.parent_path()) {
+    uuid += part.string();
+  }
+  // id is bound as text, as in is_referenced()
+  return metadata.count(
+             "SELECT COUNT(*) FROM versioned_objects "
+             "WHERE object_id = ? AND id = ?",
+             uuid, obj_path.stem().string()
+         ) > 0;
 }
 
-bool run_checks(const std::filesystem::path& path, bool should_fix) {
+/* Find Bucket - Returns the id of the (undeleted) bucket called name.
+ */
+std::string find_bucket(
+    const std::filesystem::path& path, const std::string& name
+) {
+  Database metadata(path / DB_FILENAME, true);
+  Statement& stm = metadata.query(
+      "SELECT bucket_id FROM buckets "
+      "WHERE bucket_name = ? AND (deleted IS NULL OR deleted = 0)",
+      name
+  );
+  std::vector<std::string> ids;
+  for (Row row : stm) {
+    ids.emplace_back(row.text(0));
+  }
+  if (ids.empty()) {
+    throw std::runtime_error("No bucket named " + name);
+  }
+  if (ids.size() > 1) {
+    throw std::runtime_error("More than one bucket named " + name);
+  }
+  return ids.front();
+}
+
+/* Modification Time - Returns the mtime of path in nanoseconds since the
+ * epoch, or zero if it can't be determined.
+ */
+int64_t mtime_ns(const std::filesystem::path& path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    return 0;
+  }
+  return int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+/* Log Queue Depth - Reports where the queue depth of an adaptive pipeline
+ * ended up.
+ */
+void log_queue_depth(const StatPipeline& pipeline) {
+  const AdaptiveLimit* limit = pipeline.adaptive_limit();
+  if (limit == nullptr) {
+    return;
+  }
+  Log::log_verbose(
+      "Queue depth settled at " + std::to_string(limit->limit()) +
+      " (ranged from " + std::to_string(limit->min_seen()) + " to " +
+      std::to_string(limit->max_seen()) + ")"
+  );
+}
+
+/* The clean stamp file records two things:
+ *
+ *   clean <ns>  - start time of the last fsck --fix run in which all checks
+ *                 passed
+ *   db <ns>     - mtime of sfs.db as fsck itself last left it
+ *
+ * The latter is needed because fsck closing the database also checkpoints
+ * and removes the WAL, which would otherwise look like a clean s3gw shutdown.
+ */
+struct CleanStamp {
+  int64_t clean = 0;
+  int64_t db = 0;
+};
+
+static CleanStamp read_clean_stamp(const std::filesystem::path& path) {
+  CleanStamp stamp;
+  std::ifstream in(path / CLEAN_STAMP_FILENAME);
+  std::string key;
+  int64_t value;
+  while (in >> key >> value) {
+    if (key == "clean") {
+      stamp.clean = value;
+    } else if (key == "db") {
+      stamp.db = value;
+    }
+  }
+  return stamp;
+}
+
+static void write_clean_stamp(
+    const std::filesystem::path& path, const CleanStamp& stamp
+) {
+  std::filesystem::path stamp_path(path / CLEAN_STAMP_FILENAME);
+  std::filesystem::path tmp_path(stamp_path.string() + ".tmp");
+  {
+    std::ofstream out(tmp_path, std::ios::trunc);
+    out << "clean " << stamp.clean << "\ndb " << stamp.db << "\n";
+    if (!out) {
+      Log::log_verbose("Unable to write " + tmp_path.string());
+      return;
+    }
+  }
+  std::error_code ec;
+  std::filesystem::rename(tmp_path, stamp_path, ec);
+  if (ec) {
+    Log::log_verbose("Unable to write " + stamp_path.string());
+  }
+}
+
+/* Is Cleanly Closed - SQLite removes the WAL when the last connection to a
+ * WAL mode database closes normally, so a WAL mode database without one was
+ * shut down cleanly. Byte 18 of the database header is 2 in WAL mode.
+ */
+static bool is_cleanly_closed(const std::filesystem::path& db_path) {
+  std::ifstream in(db_path, std::ios::binary);
+  char header[20];
+  if (!in.read(header, sizeof(header)) || header[18] != 2) {
+    return false;
+  }
+  return !std::filesystem::exists(db_path.string() + "-wal");
+}
+
+/* Last Clean Time - Returns the most recent point at which the store is known
+ * to have been consistent: either the last time s3gw shut down cleanly, or
+ * the last time fsck ran with all checks passing. Returns zero if neither is
+ * known. This must be called before anything opens the database.
+ */
+int64_t last_clean_time(const std::filesystem::path& path) {
+  CleanStamp stamp = read_clean_stamp(path);
+  std::filesystem::path db_path(path / DB_FILENAME);
+  int64_t since = stamp.clean;
+  int64_t db_mtime = mtime_ns(db_path);
+  if (db_mtime != stamp.db && is_cleanly_closed(db_path)) {
+    // The database has been written by something other than fsck since we
+    // last saw it, and was then closed cleanly.
+    since = std::max(since, db_mtime);
+  }
+  return since;
+}
+
+/* Run Scope - Describes which part of the store a run checks, and the
+ * options that change what checking it involves, so that an interrupted run
+ * is only picked up where it left off by a run doing the same work.
+ */
+static std::string run_scope(const Options& options) {
+  return "bucket " + options.bucket_id + " since " +
+         std::to_string(options.since) + (options.deep ? " deep" : "") +
+         (options.purge ? " purge" : "");
+}
+
+/* Run Salvaged Checks - Once the metadata database is found to be damaged,
+ * runs the checks that compare it with the filesystem against the rows that
+ * can still be read from it. What they find is only a guide, since rows on
+ * damaged pages are missing, so nothing is fixed.
+ */
+static void run_salvaged_checks(
+    const std::filesystem::path& path, const Options& options
+) {
+  Log::log("Salvaging what can be read of the metadata database");
+  std::error_code ec;
+  std::filesystem::path wal = path / (std::string(DB_FILENAME) + "-wal");
+  if (std::filesystem::file_size(wal, ec) > 0 && !ec) {
+    Log::log(
+        "  The write-ahead log isn't read, so recent changes will be missing"
+    );
+  }
+  try {
+    SalvagedMetadata salvaged(
+        path / DB_FILENAME, {"buckets", "objects", "versioned_objects",
+                             "multiparts", "multiparts_parts"}
+    );
+    Log::log(
+        "  Salvaged " + std::to_string(salvaged.rows) + " rows, skipping " +
+        std::to_string(salvaged.damaged_pages) + " damaged pages"
+    );
+    for (const std::string& table : salvaged.missing) {
+      Log::log("  Unable to find table " + table);
+    }
+
+    Options salvage_options(options);
+    salvage_options.should_fix = false;
+    salvage_options.metadata_path = salvaged.path();
+    std::vector<std::shared_ptr<Check>> checks;
+    checks.emplace_back(
+        std::make_shared<OrphanedObjectsCheck>(path, salvage_options)
+    );
+    checks.emplace_back(
+        std::make_shared<OrphanedMetadataCheck>(path, salvage_options)
+    );
+    checks.emplace_back(
+        std::make_shared<ObjectIntegrityCheck>(path, salvage_options)
+    );
+    for (std::shared_ptr<Check> check : checks) {
+      check->check();
+      check->show();
+    }
+    Log::log(
+        "These results are from salvaged metadata, so are incomplete, and "
+        "nothing has been fixed"
+    );
+  } catch (std::runtime_error& e) {
+    Log::log(std::string("Unable to salvage metadata: ") + e.what());
+  }
+}
+
+bool run_checks(const std::filesystem::path& path, const Options& options) {
   Log::log("Checking SFS store in " + path.string());
+  if (options.since > 0) {
+    time_t since = options.since / 1000000000;
+    char buf[32];
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", gmtime(&since));
+    Log::log(std::string("Only checking changes since ") + buf + " UTC");
+  }
+  if (!options.bucket_id.empty()) {
+    Log::log(
+        "Only checking objects in bucket " + options.bucket + " (id: " +
+        options.bucket_id + ")"
+    );
+  }
+  // A run limited by --since only vouches for the whole store if it goes
+  // back to a point at which the store was known to be consistent. This
+  // must be found before anything opens the database.
+  int64_t known_clean = options.since > 0 ? last_clean_time(path) : 0;
   bool all_checks_passed = true;
+  int64_t start_time =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::system_clock::now().time_since_epoch()
+      )
+          .count();
+
+  // If an earlier --fix run was interrupted, finish what it started
+  std::unique_ptr<FixJournal> journal;
+  std::map<std::string, bool> completed;
+  if (options.should_fix) {
+    bool resuming = FixJournal::exists(path);
+    journal = std::make_unique<FixJournal>(path, run_scope(options));
+    if (resuming) {
+      std::vector<FixJournal::Pending> pending;
+      bool same_scope = journal->load(pending, completed);
+      Log::log(
+          "Resuming interrupted fix run (" + std::to_string(pending.size()) +
+          " fixes outstanding)"
+      );
+      if (!same_scope) {
+        Log::log(
+            "The interrupted run checked a different bucket or time range, "
+            "or with different --deep or --purge options, so every check "
+            "will be run again"
+        );
+      }
+      Database metadata(path / DB_FILENAME);
+      for (auto& [id, fix] : pending) {
+        if (fix->recheck(metadata)) {
+          Log::log("  " + std::string(*fix));
+          fix->fix();
+        } else {
+          Log::log_verbose("Already fixed: " + std::string(*fix));
+        }
+        journal->done(id);
+      }
+      journal->sync();
+    }
+  } else if (FixJournal::exists(path)) {
+    Log::log(
+        "Found journal from an interrupted fix run; run with --fix to resume"
+    );
+  }
+
+  std::unique_ptr<PlanWriter> plan;
+  if (!options.write_plan.empty()) {
+    plan = std::make_unique<PlanWriter>(options.write_plan);
+  }
 
   std::vector<std::shared_ptr<Check>> checks;
-  checks.emplace_back(std::make_shared<MetadataIntegrityCheck>(path));
-  checks.emplace_back(std::make_shared<MetadataSchemaVersionCheck>(path));
-  checks.emplace_back(std::make_shared<OrphanedObjectsCheck>(path));
-  checks.emplace_back(std::make_shared<OrphanedMetadataCheck>(path));
-  checks.emplace_back(std::make_shared<ObjectIntegrityCheck>(path));
+  checks.emplace_back(std::make_shared<MetadataIntegrityCheck>(path, options));
+  checks.emplace_back(
+      std::make_shared<MetadataSchemaVersionCheck>(path, options)
+  );
+  checks.emplace_back(std::make_shared<DanglingReferencesCheck>(path, options));
+  checks.emplace_back(std::make_shared<OrphanedObjectsCheck>(path, options));
+  checks.emplace_back(std::make_shared<OrphanedMetadataCheck>(path, options));
+  checks.emplace_back(std::make_shared<ObjectIntegrityCheck>(path, options));
 
+  bool salvage = false;
   for (std::shared_ptr<Check> check : checks) {
+    auto previous_run = completed.find(check->name());
+    if (previous_run != completed.end()) {
+      // Checked (and fixed if need be) by the interrupted run
+      Log::log("Skipping " + check->name() + " (completed by previous run)");
+      all_checks_passed = all_checks_passed && previous_run->second;
+      continue;
+    }
     bool this_check_passed = check->check();
     check->show();
+    if (plan) {
+      check->plan(*plan);
+    }
     if (!this_check_passed) {
-      if (should_fix) {
+      if (options.should_fix && check->confirm_fixes()) {
         // Try to fix the issue if possible
         // TODO: Consider adding a 'continue' here if we know the fix
         // has succeeded, so we ultimately return success rather than
         // failure if everything is fixed.
-        check->fix();
+        check->fix(*journal);
       }
       all_checks_passed = false;
       if (check->is_fatal()) {
         // Don't do any more checks if this check failure is fatal.
         // The fix might not have worked, or might not be possible,
         // so it's not safe to proceed further.
+        salvage = check->metadata_damaged();
         break;
       }
     }
+    if (journal) {
+      journal->completed(check->name(), this_check_passed);
+    }
+  }
+
+  if (salvage) {
+    run_salvaged_checks(path, options);
+  }
+
+  if (journal) {
+    journal->remove();
+  }
+  if (plan) {
+    plan->close();
+    Log::log("Wrote fix plan to " + options.write_plan.string());
   }
 
   if (all_checks_passed) {
@@ -77,5 +464,22 @@ bool run_checks(const std::filesystem::path& path, bool should_fix) {
   } else {
     Log::log("One or more checks failed.");
   }
+
+  // Only runs which fix things write to the volume. Other runs open the
+  // database read-only, so leave its mtime (and WAL) as they found them.
+  if (options.should_fix) {
+    // Close the database before noting its mtime in the clean stamp
+    checks.clear();
+    CleanStamp stamp = read_clean_stamp(path);
+    // Passing a check of one bucket, or of changes since a time after the
+    // store was last known to be consistent, says nothing about the rest
+    if (all_checks_passed && options.bucket_id.empty() &&
+        options.since <= known_clean) {
+      stamp.clean = start_time;
+    }
+    stamp.db = mtime_ns(path / DB_FILENAME);
+    write_clean_stamp(path, stamp);
+  }
+
   return all_checks_passed;
 }
@@ -13,28 +13,94 @@
 #include <filesystem>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
+#include "serialize.h"
 #include "sqlite.h"
+#include "stat_pipeline.h"
 
 constexpr std::string_view DB_FILENAME = "sfs.db";
+constexpr std::string_view CLEAN_STAMP_FILENAME = "fsck.sfs.clean";
+constexpr unsigned DEFAULT_REVERIFY_DAYS = 30;
 
 // TODO: this thing could conceivably keep track of an indent level,
 // saving us from adding leading spaces in various places.
 struct Log {
   enum Level { SILENT, NORMAL, VERBOSE };
   inline static Level level = NORMAL;
+  // Fixes may be applied, and volumes checked, from several threads at once
+  inline static std::mutex mutex;
+  // Identifies the volume being checked by this thread, when checking several
+  inline static thread_local std::string prefix;
+  // If set, where this thread's lines are held rather than printed (see Hold)
+  inline static thread_local std::vector<std::string>* held = nullptr;
   static void log(const std::string& msg) {
     if (level > SILENT) {
-      std::cout << msg << std::endl;
+      print(msg);
     }
   }
   static void log_verbose(const std::string& msg) {
     if (level == VERBOSE) {
-      std::cout << "  " << msg << std::endl;
+      print("  " + msg);
     }
   }
+  // Prints a line as already formatted by log() or log_verbose()
+  static void print(const std::string& line) {
+    if (held) {
+      held->push_back(line);
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    std::cout << prefix << line << std::endl;
+  }
+  // While one exists, what this thread logs is held in lines, so that work
+  // done in parallel can be reported in order afterwards
+  class Hold {
+   public:
+    Hold(std::vector<std::string>& lines) { held = &lines; }
+    Hold(const Hold&) = delete;
+    Hold& operator=(const Hold&) = delete;
+    ~Hold() { held = nullptr; }
+  };
+};
+
+/* Options - Settings that apply to every check in a single run.
+ */
+struct Options {
+  bool should_fix = false;
+  // Only examine metadata rows and UUID directories modified after this
+  // point, in nanoseconds since the epoch (which is how s3gw stores its
+  // timestamps). Zero means examine everything.
+  int64_t since = 0;
+  // If set, write the fixes found to this plan file (see plan.h)
+  std::filesystem::path write_plan;
+  // How many filesystem operations checks may have in flight at once
+  unsigned queue_depth = DEFAULT_QUEUE_DEPTH;
+  // Tune how many are in flight as we go, up to queue_depth
+  bool adaptive_queue_depth = false;
+  // When checking several volumes at once, limits the filesystem operations
+  // in flight across all of them
+  std::shared_ptr<IoThrottle> throttle;
+  // Verify object checksums, which means reading every object
+  bool deep = false;
+  // Objects verified less than this many days ago, and unchanged since, are
+  // skipped by deep checks (see verification_stamps.h). Zero means never skip.
+  unsigned reverify_days = DEFAULT_REVERIFY_DAYS;
+  // Leave the page cache as it was before objects were read for verifying
+  // (see page_cache.h)
+  bool cache_neutral = false;
+  // If set, only check the objects in this bucket (see find_bucket())
+  std::string bucket;
+  std::string bucket_id;
+  // Delete orphaned objects, rather than moving them to lost+found
+  bool purge = false;
+  // Don't ask before fixes that can't be undone
+  bool assume_yes = false;
+  // If set, checks read metadata from this database rather than sfs.db (see
+  // salvage.h)
+  std::filesystem::path metadata_path;
 };
 
 /* Fix - This is an abstract datatype representing an executable action to fix
@@ -45,12 +111,35 @@ class Fix {
   const std::filesystem::path& root_path;
 
  public:
+  // Identifies the type of a fix in an encoded record
+  enum Tag : uint8_t {
+    ORPHANED_OBJECTS = 1,
+    METADATA_INTEGRITY,
+    METADATA_SCHEMA_VERSION,
+    ORPHANED_METADATA,
+    OBJECT_INTEGRITY,
+    DANGLING_REFERENCE
+  };
+
   Fix(const std::filesystem::path& path) : root_path(path) {}
   virtual ~Fix(){};
   virtual operator std::string() const = 0;
   virtual void fix() = 0;
+  // Fixes encode themselves, starting with their Tag, so they can be written
+  // to fix journals and plans, and later recreated with decode_fix().
+  virtual void encode(Encoder& out) const = 0;
+  // Whether fix() actually changes anything (some problems can only be
+  // reported). Only these are journaled.
+  virtual bool modifies_store() const { return false; }
+  // A cheap test, before replaying a fix, that it's still needed
+  virtual bool recheck(Database&) const { return true; }
 };
 
+std::shared_ptr<Fix> decode_fix(const std::filesystem::path& root, Decoder& in);
+
+class FixJournal;
+class PlanWriter;
+
 /* Check - This is an abstract datatype representing exectutable action that
  * examines the given filesystem for a specific defect and products a list of
  * fixes. This can then be either acted upon to fix the filesystem or just be
@@ -62,22 +151,54 @@ class Check {
   const std::string check_name;
   enum Fatality { FATAL, NONFATAL } fatality;
   const std::filesystem::path& root_path;
+  const Options& options;
   std::unique_ptr<Database> metadata;
   virtual bool do_check() = 0;
+  // Called once every fix has been applied, for checks which batch up the
+  // work their fixes do
+  virtual void finish_fixes() {}
 
  public:
-  Check(const std::string& name, Fatality f, const std::filesystem::path& path)
+  Check(
+      const std::string& name, Fatality f, const std::filesystem::path& path,
+      const Options& opts
+  )
       : check_name(name),
         fatality(f),
         root_path(path),
-        metadata(std::make_unique<Database>(path / DB_FILENAME)) {}
+        options(opts),
+        // Read-only unless fixing, so that checking doesn't modify sfs.db
+        // (not even by checkpointing its WAL on close)
+        metadata(std::make_unique<Database>(
+            opts.metadata_path.empty() ? path / DB_FILENAME
+                                       : opts.metadata_path,
+            !opts.should_fix
+        )) {
+    metadata->record_plans = Log::level == Log::VERBOSE;
+  }
   virtual ~Check(){};
   bool check();
   bool is_fatal() { return fatality == FATAL; }
-  void fix();
+  const std::string& name() const { return check_name; }
+  // Whether to go ahead with fixes that can't be undone, asking if need be
+  virtual bool confirm_fixes() { return true; }
+  // Whether failing this check means the metadata database is damaged, in
+  // which case what can be read of it is salvaged to run the other checks
+  virtual bool metadata_damaged() const { return false; }
+  void fix(FixJournal& journal);
+  void plan(PlanWriter& plan);
   void show();
 };
 
-bool run_checks(const std::filesystem::path& path, bool should_fix);
+std::filesystem::path uuid_path(std::string_view uuid);
+std::filesystem::path version_path(std::string_view uuid, std::string_view id);
+bool version_exists(Database& metadata, const std::filesystem::path& obj_path);
+int64_t mtime_ns(const std::filesystem::path& path);
+void log_queue_depth(const StatPipeline& pipeline);
+int64_t last_clean_time(const std::filesystem::path& path);
+std::string find_bucket(
+    const std::filesystem::path& path, const std::string& name
+);
+bool run_checks(const std::filesystem::path& path, const Options& options);
 
 #endif  // FSCK_SFS_SRC_CHECKS_H__
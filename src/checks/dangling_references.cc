@@ -0,0 +1,256 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ */
+
+#include "dangling_references.h"
+
+#include <functional>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "thread_pool.h"
+#include "trace.h"
+
+/* Dangling Condition - The table a dangling row of each type is in, and the
+ * condition (on the row with primary key ?1) under which it's dangling.
+ */
+static std::pair<std::string, std::string> dangling_condition(
+    DanglingReferenceFix::Type type
+) {
+  switch (type) {
+    case DanglingReferenceFix::OBJECT_WITHOUT_VERSIONS:
+      return {
+          "objects",
+          "uuid = ?1 AND NOT EXISTS (SELECT 1 FROM versioned_objects "
+          "WHERE object_id = ?1)"};
+    case DanglingReferenceFix::VERSION_WITHOUT_OBJECT:
+      return {
+          "versioned_objects",
+          "id = ?1 AND NOT EXISTS (SELECT 1 FROM objects "
+          "WHERE uuid = versioned_objects.object_id)"};
+    case DanglingReferenceFix::ORPHANED_PART:
+      return {
+          "multiparts_parts",
+          "id = ?1 AND NOT EXISTS (SELECT 1 FROM multiparts "
+          "WHERE upload_id = multiparts_parts.upload_id)"};
+  }
+  throw std::runtime_error("Unknown dangling reference type");
+}
+
+void DeleteBatch::remove(const DanglingReferenceFix& fix) {
+  if (!open) {
+    metadata.query("BEGIN IMMEDIATE").step();
+    open = true;
+  }
+  fix.remove_from(metadata);
+  deleted.push_back(fix.row());
+  if (deleted.size() >= DELETE_BATCH_SIZE) {
+    commit();
+  }
+}
+
+void DeleteBatch::commit() {
+  if (!open) {
+    return;
+  }
+  // Deletions are only reported once they've been committed, as until then
+  // they can still be lost
+  try {
+    metadata.query("COMMIT").step();
+    for (const std::string& row : deleted) {
+      Log::log("  Deleted dangling " + row);
+    }
+  } catch (std::runtime_error& ex) {
+    Log::log(
+        "  Error: unable to delete " + std::to_string(deleted.size()) +
+        " dangling rows: " + ex.what()
+    );
+    try {
+      metadata.query("ROLLBACK").step();
+    } catch (std::runtime_error&) {
+      // Already rolled back by SQLite
+    }
+  }
+  open = false;
+  deleted.clear();
+}
+
+std::string DanglingReferenceFix::row() const {
+  return dangling_condition(type).first + " row " + key;
+}
+
+void DanglingReferenceFix::remove_from(Database& metadata) const {
+  auto [table, condition] = dangling_condition(type);
+  metadata.query("DELETE FROM " + table + " WHERE " + condition, key).step();
+}
+
+void DanglingReferenceFix::fix() {
+  try {
+    if (batch) {
+      // Reported when the batch is committed
+      batch->remove(*this);
+    } else {
+      // Replayed from a journal or plan, so there's no batch to join
+      Database metadata(root_path / DB_FILENAME);
+      remove_from(metadata);
+      Log::log("  Deleted dangling " + row());
+    }
+  } catch (std::runtime_error& ex) {
+    Log::log("  Error: unable to delete " + row() + ": " + ex.what());
+  }
+}
+
+void DanglingReferenceFix::encode(Encoder& out) const {
+  out.put_u8(DANGLING_REFERENCE);
+  out.put_u8(type);
+  out.put_string(key);
+  out.put_string(target);
+}
+
+std::shared_ptr<Fix> DanglingReferenceFix::decode(
+    const std::filesystem::path& root, Decoder& in
+) {
+  uint8_t type = in.get_u8();
+  if (type > ORPHANED_PART) {
+    throw std::runtime_error("Unknown dangling reference type in record");
+  }
+  std::string key = in.get_string();
+  return std::make_shared<DanglingReferenceFix>(
+      static_cast<Type>(type), root, key, in.get_string()
+  );
+}
+
+bool DanglingReferenceFix::recheck(Database& metadata) const {
+  auto [table, condition] = dangling_condition(type);
+  return metadata.count(
+             "SELECT COUNT(*) FROM " + table + " WHERE " + condition, key
+         ) > 0;
+}
+
+std::string DanglingReferenceFix::to_string() const {
+  switch (type) {
+    case OBJECT_WITHOUT_VERSIONS:
+      return "Found object without versions: " + key;
+    case VERSION_WITHOUT_OBJECT:
+      return "Found version " + key + " of missing object " + target;
+    case ORPHANED_PART:
+      return "Found part " + key + " of missing multipart upload " + target;
+  }
+  return "Found dangling reference: " + key;
+}
+
+/* Anti Join - Calls found for each row of left whose first column matches
+ * the first column of no row in right. Both must be ordered by that column.
+ */
+static void anti_join(
+    Statement& left, Statement& right, const std::function<void(Row)>& found
+) {
+  bool more_right = right.step();
+  for (Row row : left) {
+    std::string_view key = row.text(0);
+    while (more_right && right.row().text(0) < key) {
+      more_right = right.step();
+    }
+    if (!more_right || right.row().text(0) != key) {
+      found(row);
+    }
+  }
+  right.reset();
+}
+
+bool DanglingReferencesCheck::do_check() {
+  // One scan per relationship: the rows of the left query (key, then the
+  // dangling row's primary key) whose key isn't in the right query
+  struct Scan {
+    DanglingReferenceFix::Type type;
+    std::string left;
+    std::string right;
+    std::vector<std::pair<std::string, std::string>> found;
+  };
+  std::vector<Scan> scans;
+  if (!options.bucket_id.empty()) {
+    // Versions and parts whose object or upload is missing can't be tied to
+    // a bucket, so only objects are checked
+    scans.push_back(
+        {DanglingReferenceFix::OBJECT_WITHOUT_VERSIONS,
+         "SELECT uuid, uuid FROM objects WHERE bucket_id = ?1 ORDER BY uuid",
+         "SELECT object_id FROM versioned_objects "
+         "WHERE object_id IS NOT NULL ORDER BY object_id",
+         {}}
+    );
+  } else {
+    // objects has no timestamps, so can't be limited by --since
+    scans.push_back(
+        {DanglingReferenceFix::OBJECT_WITHOUT_VERSIONS,
+         "SELECT uuid, uuid FROM objects ORDER BY uuid",
+         "SELECT object_id FROM versioned_objects "
+         "WHERE object_id IS NOT NULL ORDER BY object_id",
+         {}}
+    );
+    scans.push_back(
+        {DanglingReferenceFix::VERSION_WITHOUT_OBJECT,
+         std::string("SELECT object_id, id FROM versioned_objects "
+                     "WHERE object_id IS NOT NULL") +
+             (options.since > 0 ? " AND (mtime > ?1 OR commit_time > ?1)"
+                                : "") +
+             " ORDER BY object_id",
+         "SELECT uuid FROM objects ORDER BY uuid",
+         {}}
+    );
+    scans.push_back(
+        {DanglingReferenceFix::ORPHANED_PART,
+         std::string("SELECT upload_id, id FROM multiparts_parts") +
+             (options.since > 0 ? " WHERE mtime > ?1" : "") +
+             " ORDER BY upload_id",
+         "SELECT upload_id FROM multiparts ORDER BY upload_id",
+         {}}
+    );
+  }
+
+  {
+    ThreadPool pool(scans.size(), scans.size());
+    for (Scan& scan : scans) {
+      pool.submit([&] {
+        TraceSpan span("scan", scan.left);
+        Database db(root_path / DB_FILENAME, true);
+        Statement& left = db.prepare(scan.left);
+        if (!options.bucket_id.empty()) {
+          left.bind(1, options.bucket_id);
+        } else if (options.since > 0 &&
+                   scan.type != DanglingReferenceFix::OBJECT_WITHOUT_VERSIONS) {
+          left.bind(1, options.since);
+        }
+        anti_join(left, db.prepare(scan.right), [&](Row row) {
+          scan.found.emplace_back(row.text(1), row.text(0));
+        });
+      });
+    }
+    pool.wait();
+  }
+
+  batch = std::make_shared<DeleteBatch>(*metadata);
+  for (Scan& scan : scans) {
+    for (auto& [key, target] : scan.found) {
+      fixes.emplace_back(std::make_shared<DanglingReferenceFix>(
+          scan.type, root_path, key,
+          scan.type == DanglingReferenceFix::OBJECT_WITHOUT_VERSIONS ? ""
+                                                                     : target,
+          batch
+      ));
+    }
+  }
+  return fixes.empty();
+}
+
+void DanglingReferencesCheck::finish_fixes() {
+  if (batch) {
+    batch->commit();
+  }
+}
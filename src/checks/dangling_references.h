@@ -0,0 +1,102 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ *
+ * - - -
+ *
+ * Dangling References Check
+ * A crash can leave rows in one metadata table referring to rows in another
+ * that don't exist: objects with no versions, versions of objects that don't
+ * exist, and parts of multipart uploads that don't exist. Each relationship
+ * is checked with a single pass over both tables, in key order (which indexes
+ * mostly provide for free), merging the two as we go. The relationships are
+ * checked in parallel, each on its own read only connection.
+ *
+ * The fix is to delete the dangling rows, which is done in batches, each in a
+ * single transaction.
+ */
+
+#ifndef FSCK_SFS_SRC_CHECKS_DANGLING_REFERENCES_H__
+#define FSCK_SFS_SRC_CHECKS_DANGLING_REFERENCES_H__
+
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "checks.h"
+
+// Number of rows deleted in each transaction
+constexpr size_t DELETE_BATCH_SIZE = 1000;
+
+class DanglingReferenceFix;
+
+/* Delete Batch - Groups the deletions made by fixes into transactions of up to
+ * DELETE_BATCH_SIZE rows.
+ */
+class DeleteBatch {
+ private:
+  Database& metadata;
+  bool open;  // in a transaction
+  // The rows deleted in the open transaction
+  std::vector<std::string> deleted;
+
+ public:
+  DeleteBatch(Database& db) : metadata(db), open(false) {}
+  void remove(const DanglingReferenceFix& fix);
+  // Commits any deletions not yet committed, and reports them. If that
+  // fails, reports that instead, rather than throwing.
+  void commit();
+};
+
+class DanglingReferenceFix : public Fix {
+ public:
+  enum Type { OBJECT_WITHOUT_VERSIONS, VERSION_WITHOUT_OBJECT, ORPHANED_PART };
+  DanglingReferenceFix(
+      Type t, const std::filesystem::path& root, const std::string& _key,
+      const std::string& _target,
+      std::shared_ptr<DeleteBatch> _batch = nullptr
+  )
+      : Fix(root), type(t), key(_key), target(_target), batch(_batch) {}
+  operator std::string() const { return to_string(); };
+  void fix();
+  void encode(Encoder& out) const;
+  bool modifies_store() const { return true; }
+  bool recheck(Database& metadata) const;
+  static std::shared_ptr<Fix> decode(
+      const std::filesystem::path& root, Decoder& in
+  );
+  // Deletes the dangling row, if it's still dangling
+  void remove_from(Database& metadata) const;
+  // Describes the dangling row, e.g. "objects row <uuid>"
+  std::string row() const;
+
+ private:
+  Type type;
+  std::string key;     // primary key of the dangling row
+  std::string target;  // the missing row it refers to, if any
+  std::shared_ptr<DeleteBatch> batch;
+  std::string to_string() const;
+};
+
+class DanglingReferencesCheck : public Check {
+ private:
+  std::shared_ptr<DeleteBatch> batch;
+
+ protected:
+  virtual bool do_check() override;
+  virtual void finish_fixes() override;
+
+ public:
+  DanglingReferencesCheck(
+      const std::filesystem::path& path, const Options& opts
+  )
+      : Check("dangling references", NONFATAL, path, opts) {}
+  virtual ~DanglingReferencesCheck() override {}
+};
+
+#endif  // FSCK_SFS_SRC_CHECKS_DANGLING_REFERENCES_H__
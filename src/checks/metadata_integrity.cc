@@ -24,6 +24,24 @@ void MetadataIntegrityFix::fix() {
   Log::log("  Metadata integrity cannot be automatically fixed.");
 }
 
+void MetadataIntegrityFix::encode(Encoder& out) const {
+  out.put_u8(METADATA_INTEGRITY);
+  out.put_varint(errors.size());
+  for (auto& s : errors) {
+    out.put_string(s);
+  }
+}
+
+std::shared_ptr<Fix> MetadataIntegrityFix::decode(
+    const std::filesystem::path& root, Decoder& in
+) {
+  std::vector<std::string> errors(in.get_varint());
+  for (auto& s : errors) {
+    s = in.get_string();
+  }
+  return std::make_shared<MetadataIntegrityFix>(root, errors);
+}
+
 std::string MetadataIntegrityFix::to_string() const {
   std::string msg("Database integrity check failed:");
   for (auto& s : errors) {
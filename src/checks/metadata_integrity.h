@@ -26,6 +26,10 @@ class MetadataIntegrityFix : public Fix {
   );
   operator std::string() const { return to_string(); };
   void fix();
+  void encode(Encoder& out) const;
+  static std::shared_ptr<Fix> decode(
+      const std::filesystem::path& root, Decoder& in
+  );
 };
 
 class MetadataIntegrityCheck : public Check {
@@ -33,9 +37,12 @@ class MetadataIntegrityCheck : public Check {
   virtual bool do_check() override;
 
  public:
-  MetadataIntegrityCheck(const std::filesystem::path& path)
-      : Check("metadata integrity", FATAL, path) {}
+  MetadataIntegrityCheck(
+      const std::filesystem::path& path, const Options& opts
+  )
+      : Check("metadata integrity", FATAL, path, opts) {}
   virtual ~MetadataIntegrityCheck() override{};
+  virtual bool metadata_damaged() const override { return true; }
 };
 
 #endif  // FSCK_SFS_SRC_CHECKS_METADATA_INTEGRITY_H__
@@ -23,6 +23,18 @@ void MetadataSchemaVersionFix::fix() {
   Log::log("  Metadata schema version cannot be automatically fixed.");
 }
 
+void MetadataSchemaVersionFix::encode(Encoder& out) const {
+  out.put_u8(METADATA_SCHEMA_VERSION);
+  out.put_varint(static_cast<uint32_t>(schema_version));
+}
+
+std::shared_ptr<Fix> MetadataSchemaVersionFix::decode(
+    const std::filesystem::path& root, Decoder& in
+) {
+  int version = static_cast<int>(static_cast<uint32_t>(in.get_varint()));
+  return std::make_shared<MetadataSchemaVersionFix>(root, version);
+}
+
 std::string MetadataSchemaVersionFix::to_string() const {
   return "Wrong metadata schema version: got " +
          std::to_string(schema_version) +
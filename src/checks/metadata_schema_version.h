@@ -30,6 +30,10 @@ class MetadataSchemaVersionFix : public Fix {
   MetadataSchemaVersionFix(const std::filesystem::path& path, int version);
   operator std::string() const { return to_string(); };
   void fix();
+  void encode(Encoder& out) const;
+  static std::shared_ptr<Fix> decode(
+      const std::filesystem::path& root, Decoder& in
+  );
 };
 
 class MetadataSchemaVersionCheck : public Check {
@@ -37,8 +41,10 @@ class MetadataSchemaVersionCheck : public Check {
   virtual bool do_check() override;
 
  public:
-  MetadataSchemaVersionCheck(const std::filesystem::path& path)
-      : Check("metadata schema version", FATAL, path) {}
+  MetadataSchemaVersionCheck(
+      const std::filesystem::path& path, const Options& opts
+  )
+      : Check("metadata schema version", FATAL, path, opts) {}
   virtual ~MetadataSchemaVersionCheck() override {}
 };
 
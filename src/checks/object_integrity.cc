@@ -11,8 +11,26 @@
 
 #include <sqlite3.h>
 
+#include <strings.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
 #include <filesystem>
 #include <iostream>
+#include <vector>
+
+#include "md5.h"
+#include "md5_multi.h"
+#include "page_cache.h"
+#include "read_scheduler.h"
+#include "trace.h"
+#include "verification_stamps.h"
+
+constexpr size_t READ_BUFFER_SIZE = 1024 * 1024;
 
 ObjectIntegrityFix::ObjectIntegrityFix(
     const std::filesystem::path& root, const std::filesystem::path& object,
@@ -28,11 +46,123 @@ void ObjectIntegrityFix::fix() {
   Log::log("  Object integrity cannot be automatically fixed.");
 }
 
+void ObjectIntegrityFix::encode(Encoder& out) const {
+  out.put_u8(OBJECT_INTEGRITY);
+  out.put_string(obj_path.string());
+  out.put_string(reason);
+}
+
+std::shared_ptr<Fix> ObjectIntegrityFix::decode(
+    const std::filesystem::path& root, Decoder& in
+) {
+  std::string obj_path = in.get_string();
+  return std::make_shared<ObjectIntegrityFix>(root, obj_path, in.get_string());
+}
+
+bool ObjectIntegrityFix::recheck(Database& metadata) const {
+  // The object may have since been deleted
+  return version_exists(metadata, obj_path);
+}
+
 std::string ObjectIntegrityFix::to_string() const {
   return "Object data integrity check failed: " + obj_path.string() + "\n  " +
          reason;
 }
 
+/* Is MD5 - Whether checksum looks like an MD5 hex digest. Objects without
+ * one can't have their contents verified.
+ */
+static bool is_md5(std::string_view checksum) {
+  return checksum.size() == 32 &&
+         std::all_of(checksum.begin(), checksum.end(), [](unsigned char c) {
+           return std::isxdigit(c) != 0;
+         });
+}
+
+/* Read Some - Reads up to size bytes from fd into buf, retrying if
+ * interrupted. Records a fix if the read fails.
+ */
+ssize_t ObjectIntegrityCheck::read_some(
+    int fd, const std::filesystem::path& obj_path, char* buf, size_t size
+) {
+  ssize_t n;
+  do {
+    n = read(fd, buf, size);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) {
+    fixes.emplace_back(std::make_shared<ObjectIntegrityFix>(
+        root_path, obj_path, std::string("read failed: ") + strerror(errno)
+    ));
+  }
+  return n;
+}
+
+/* Read Object - Reads the whole of a small object from fd into data.
+ */
+bool ObjectIntegrityCheck::read_object(
+    int fd, const std::filesystem::path& obj_path, size_t size,
+    std::string& data
+) {
+  TraceSpan span("read object", obj_path.native());
+  PageCacheGuard cache(fd, size, options.cache_neutral);
+  // One more than the expected size, so growth is noticed without reading
+  // again to find the end of the file
+  data.resize(size + 1);
+  size_t used = 0;
+  while (true) {
+    ssize_t n =
+        read_some(fd, obj_path, data.data() + used, data.size() - used);
+    if (n <= 0) {
+      data.resize(used);
+      return n == 0;
+    }
+    used += n;
+    cache.advance(used);
+    if (used == data.size()) {
+      data.resize(data.size() * 2);
+    }
+  }
+}
+
+/* Verify Checksum - Reads the object from fd and compares its MD5 digest with
+ * the one recorded in the metadata. Used for objects too large to be queued
+ * for hashing in bulk.
+ */
+bool ObjectIntegrityCheck::verify_checksum(
+    int fd, const std::filesystem::path& obj_path, size_t size,
+    const std::string& checksum
+) {
+  TraceSpan span("verify object", obj_path.native());
+  PageCacheGuard cache(fd, size, options.cache_neutral);
+  std::vector<char> buffer(READ_BUFFER_SIZE);
+  Md5 md5;
+  uint64_t offset = 0;
+  ssize_t n;
+  while ((n = read_some(fd, obj_path, buffer.data(), buffer.size())) > 0) {
+    md5.update(buffer.data(), n);
+    offset += n;
+    cache.advance(offset);
+  }
+  return n == 0 && checksum_matches(obj_path, md5.hex_digest(), checksum);
+}
+
+/* Checksum Matches - Compares the MD5 digest of an object with the checksum
+ * recorded in its metadata.
+ */
+bool ObjectIntegrityCheck::checksum_matches(
+    const std::filesystem::path& obj_path, const std::string& digest,
+    const std::string& checksum
+) {
+  if (strcasecmp(digest.c_str(), checksum.c_str()) != 0) {
+    fixes.emplace_back(std::make_shared<ObjectIntegrityFix>(
+        root_path, obj_path,
+        "checksum mismatch (got " + digest + ", expected " + checksum + ")"
+    ));
+    return false;
+  }
+  return true;
+}
+
 bool ObjectIntegrityCheck::do_check() {
   int fail_count = 0;
   // TODO: is there any sense in implementing this as a separate check
@@ -40,51 +170,143 @@ bool ObjectIntegrityCheck::do_check() {
   // OrphanedMetadataCheck, given it's just an expanded form of the same
   // query, and the rest of the code is about the same...?
   std::string query =
-      "SELECT object_id, id, checksum, size FROM versioned_objects "
-      "WHERE object_id IS NOT NULL;";
-
-  Statement stm(metadata->handle, query);
-  int rc = sqlite3_step(stm);
-  while (rc == SQLITE_ROW && sqlite3_column_count(stm) > 0) {
-    std::string uuid{
-        reinterpret_cast<const char*>(sqlite3_column_text(stm, 0))};
-    std::string id{reinterpret_cast<const char*>(sqlite3_column_text(stm, 1))};
-    Log::log_verbose("Checking object " + id + " (uuid: " + uuid + ")");
-    id.append(".v");
-    std::string checksum{
-        reinterpret_cast<const char*>(sqlite3_column_text(stm, 2))};
-    std::uintmax_t object_size = sqlite3_column_int64(stm, 3);
-    // first/second/fname logic lifted from sfs's UUIDPath class
-    // *again* as we already did in OrphanedMetadataCheck
-    // TODO: dedupe this
-    std::filesystem::path first = uuid.substr(0, 2);
-    std::filesystem::path second = uuid.substr(2, 2);
-    std::filesystem::path fname = uuid.substr(4);
-    std::filesystem::path obj_path = first / second / fname / id;
-
-    // Have to check the file exists first (it won't exist if it's
-    // orphaned metadata, but as all checks run independently of
-    // each other, we have to re-check here - this is another argument
-    // for folding the integrity check into the orphaned metadata check)
-    if (std::filesystem::exists(root_path / obj_path) &&
-        std::filesystem::is_regular_file(root_path / obj_path)) {
-      std::uintmax_t file_size =
-          std::filesystem::file_size(root_path / obj_path);
-      if (file_size != object_size) {
-        fixes.emplace_back(std::make_shared<ObjectIntegrityFix>(
-            root_path, obj_path,
-            std::string(
-                "size mismatch (got " + std::to_string(file_size) +
-                ", expected " + std::to_string(object_size) + ")"
-            )
-        ));
-        fail_count++;
-      }
-
-      // TODO: implement checksum check
-    }
+      "SELECT versioned_objects.object_id, versioned_objects.id, "
+      "versioned_objects.checksum, versioned_objects.size "
+      "FROM versioned_objects";
+  if (!options.bucket_id.empty()) {
+    query += " JOIN objects ON objects.uuid = versioned_objects.object_id";
+  }
+  query += " WHERE versioned_objects.object_id IS NOT NULL";
+  if (options.since > 0) {
+    query +=
+        " AND (versioned_objects.mtime > ?1 OR "
+        "versioned_objects.commit_time > ?1)";
+  }
+  if (!options.bucket_id.empty()) {
+    query += " AND objects.bucket_id = ?2";
+  }
+
+  Statement& stm = metadata->prepare(query);
+  if (options.since > 0) {
+    stm.bind(1, options.since);
+  }
+  if (!options.bucket_id.empty()) {
+    stm.bind(2, options.bucket_id);
+  }
+  StatPipeline pipeline(
+      options.queue_depth, options.throttle, options.adaptive_queue_depth
+  );
+  // With --deep, objects of the expected size are read back to verify their
+  // checksums, in batches ordered by where they are on disk, unless they've
+  // been verified recently and haven't changed since. Small objects are
+  // queued up and hashed several at a time.
+  ReadScheduler reads;
+  Md5Queue hashes;
+  // Recording stamps writes to the objects, so only fix runs do so
+  VerificationStamps stamps(root_path, options.should_fix);
+  int64_t not_before = INT64_MAX;
+  if (options.reverify_days > 0) {
+    not_before = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     (std::chrono::system_clock::now() -
+                      std::chrono::hours(24) * options.reverify_days)
+                         .time_since_epoch()
+    )
+                     .count();
+  }
+  int skip_count = 0;
+  Log::log_verbose(
+      pipeline.using_io_uring() ? "Using io_uring for stat calls"
+                                : "Using threads for stat calls"
+  );
+  if (options.deep) {
+    Log::log_verbose(
+        std::string("Hashing small objects using ") + md5_multi_backend()
+    );
+  }
+  for (Row row : stm) {
+    std::string_view uuid = row.text(0);
+    std::string_view id = row.text(1);
+    Log::log_verbose(
+        "Checking object " + std::string(id) + " (uuid: " + std::string(uuid) +
+        ")"
+    );
+    std::string checksum(row.text(2));
+    std::uintmax_t object_size = row.int64(3);
+    std::filesystem::path obj_path = version_path(uuid, id);
 
-    rc = sqlite3_step(stm);
+    pipeline.submit(
+        (root_path / obj_path).string(),
+        [&, obj_path, object_size,
+         checksum](const StatPipeline::Result& result) {
+          // Have to check the file exists first (it won't exist if it's
+          // orphaned metadata, but as all checks run independently of
+          // each other, we have to re-check here - this is another argument
+          // for folding the integrity check into the orphaned metadata check)
+          if (!result.is_regular_file()) {
+            return;
+          }
+          std::uintmax_t file_size = result.stx.stx_size;
+          if (file_size != object_size) {
+            fixes.emplace_back(std::make_shared<ObjectIntegrityFix>(
+                root_path, obj_path,
+                std::string(
+                    "size mismatch (got " + std::to_string(file_size) +
+                    ", expected " + std::to_string(object_size) + ")"
+                )
+            ));
+            fail_count++;
+            return;
+          }
+
+          if (options.deep && is_md5(checksum)) {
+            if (stamps.is_current(obj_path, result.stx, checksum, not_before)) {
+              Log::log_verbose("Recently verified: " + obj_path.string());
+              skip_count++;
+              return;
+            }
+            reads.add(
+                (root_path / obj_path).string(), result.stx.stx_ino,
+                [&, obj_path, checksum, stx = result.stx](int fd) {
+                  if (stx.stx_size > MD5_QUEUE_OBJECT_SIZE) {
+                    if (verify_checksum(fd, obj_path, stx.stx_size, checksum)) {
+                      stamps.record(obj_path, stx, checksum);
+                    } else {
+                      fail_count++;
+                    }
+                    return;
+                  }
+                  std::string data;
+                  if (!read_object(fd, obj_path, stx.stx_size, data)) {
+                    fail_count++;
+                    return;
+                  }
+                  hashes.add(
+                      std::move(data),
+                      [&, obj_path, checksum, stx](const std::string& digest) {
+                        if (checksum_matches(obj_path, digest, checksum)) {
+                          stamps.record(obj_path, stx, checksum);
+                        } else {
+                          fail_count++;
+                        }
+                      }
+                  );
+                }
+            );
+          }
+        }
+    );
+  }
+  pipeline.drain();
+  log_queue_depth(pipeline);
+  reads.flush();
+  hashes.flush();
+  stamps.save();
+  if (skip_count > 0) {
+    Log::log_verbose(
+        "Skipped " + std::to_string(skip_count) +
+        " objects verified in the last " +
+        std::to_string(options.reverify_days) + " days"
+    );
   }
 
   return fail_count == 0;
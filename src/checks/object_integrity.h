@@ -18,6 +18,10 @@
 #ifndef FSCK_SFS_SRC_CHECKS_OBJECT_INTEGRITY_H__
 #define FSCK_SFS_SRC_CHECKS_OBJECT_INTEGRITY_H__
 
+#include <sys/types.h>
+
+#include <string>
+
 #include "checks.h"
 
 class ObjectIntegrityFix : public Fix {
@@ -31,15 +35,39 @@ class ObjectIntegrityFix : public Fix {
   ObjectIntegrityFix(const std::filesystem::path& root, const std::filesystem::path& object, const std::string&);
   operator std::string() const { return to_string(); };
   void fix();
+  void encode(Encoder& out) const;
+  bool recheck(Database& metadata) const;
+  static std::shared_ptr<Fix> decode(
+      const std::filesystem::path& root, Decoder& in
+  );
 };
 
 class ObjectIntegrityCheck : public Check {
+ private:
+  ssize_t read_some(
+      int fd, const std::filesystem::path& obj_path, char* buf, size_t size
+  );
+  bool read_object(
+      int fd, const std::filesystem::path& obj_path, size_t size,
+      std::string& data
+  );
+  bool verify_checksum(
+      int fd, const std::filesystem::path& obj_path, size_t size,
+      const std::string& checksum
+  );
+  bool checksum_matches(
+      const std::filesystem::path& obj_path, const std::string& digest,
+      const std::string& checksum
+  );
+
  protected:
   virtual bool do_check() override;
 
  public:
-  ObjectIntegrityCheck(const std::filesystem::path& path)
-      : Check("object integrity", NONFATAL, path) {}
+  ObjectIntegrityCheck(
+      const std::filesystem::path& path, const Options& opts
+  )
+      : Check("object integrity", NONFATAL, path, opts) {}
   virtual ~ObjectIntegrityCheck() override{};
 };
 
@@ -29,6 +29,26 @@ void OrphanedMetadataFix::fix() {
   Log::log("  Orphaned metadata fix not yet implemented.");
 }
 
+void OrphanedMetadataFix::encode(Encoder& out) const {
+  out.put_u8(ORPHANED_METADATA);
+  out.put_string(obj_path.string());
+}
+
+std::shared_ptr<Fix> OrphanedMetadataFix::decode(
+    const std::filesystem::path& root, Decoder& in
+) {
+  return std::make_shared<OrphanedMetadataFix>(root, in.get_string());
+}
+
+bool OrphanedMetadataFix::recheck(Database& metadata) const {
+  if (std::filesystem::is_regular_file(root_path / obj_path)) {
+    // The object has turned up since
+    return false;
+  }
+  // Or the metadata has gone (e.g. deleted as a dangling reference)
+  return version_exists(metadata, obj_path);
+}
+
 std::string OrphanedMetadataFix::to_string() const {
   return "Found orphaned metadata: " + obj_path.string();
 }
@@ -39,31 +59,59 @@ bool OrphanedMetadataCheck::do_check() {
   // to get bucket id and object name for display purposes if something
   // is broken?
   std::string query =
-      "SELECT object_id, id FROM versioned_objects WHERE object_id IS NOT "
-      "NULL;";
-  Statement stm(metadata->handle, query);
+      "SELECT versioned_objects.object_id, versioned_objects.id "
+      "FROM versioned_objects";
+  if (!options.bucket_id.empty()) {
+    query += " JOIN objects ON objects.uuid = versioned_objects.object_id";
+  }
+  query += " WHERE versioned_objects.object_id IS NOT NULL";
+  if (options.since > 0) {
+    query +=
+        " AND (versioned_objects.mtime > ?1 OR "
+        "versioned_objects.commit_time > ?1)";
+  }
+  if (!options.bucket_id.empty()) {
+    query += " AND objects.bucket_id = ?2";
+  }
+  Statement& stm = metadata->prepare(query);
+  if (options.since > 0) {
+    stm.bind(1, options.since);
+  }
+  if (!options.bucket_id.empty()) {
+    stm.bind(2, options.bucket_id);
+  }
 
-  int rc = sqlite3_step(stm);
-  while (rc == SQLITE_ROW && sqlite3_column_count(stm) > 0) {
-    std::string uuid{
-        reinterpret_cast<const char*>(sqlite3_column_text(stm, 0))};
-    std::string id{reinterpret_cast<const char*>(sqlite3_column_text(stm, 1))};
-    Log::log_verbose("Checking object " + id + " (uuid: " + uuid + ")");
-    id.append(".v");
-    // first/second/fname logic lifted from sfs's UUIDPath class
-    std::filesystem::path first = uuid.substr(0, 2);
-    std::filesystem::path second = uuid.substr(2, 2);
-    std::filesystem::path fname = uuid.substr(4);
-    std::filesystem::path obj_path = first / second / fname / id;
-    if (!(std::filesystem::exists(root_path / obj_path) &&
-          std::filesystem::is_regular_file(root_path / obj_path))) {
-      fixes.emplace_back(
-          std::make_shared<OrphanedMetadataFix>(root_path, obj_path)
-      );
-      orphan_count++;
-    }
-    rc = sqlite3_step(stm);
+  // Rows are streamed into the pipeline, which keeps many stat calls in flight
+  // at once, and calls back here as they complete.
+  StatPipeline pipeline(
+      options.queue_depth, options.throttle, options.adaptive_queue_depth
+  );
+  Log::log_verbose(
+      pipeline.using_io_uring() ? "Using io_uring for stat calls"
+                                : "Using threads for stat calls"
+  );
+  for (Row row : stm) {
+    std::string_view uuid = row.text(0);
+    std::string_view id = row.text(1);
+    Log::log_verbose(
+        "Checking object " + std::string(id) + " (uuid: " + std::string(uuid) +
+        ")"
+    );
+    std::filesystem::path obj_path = version_path(uuid, id);
+    pipeline.submit(
+        (root_path / obj_path).string(),
+        [&, obj_path](const StatPipeline::Result& result) {
+          if (!result.is_regular_file()) {
+            fixes.emplace_back(
+                std::make_shared<OrphanedMetadataFix>(root_path, obj_path)
+            );
+            orphan_count++;
+          }
+        }
+    );
   }
+  pipeline.drain();
+  log_queue_depth(pipeline);
 
   return orphan_count == 0;
 }
@@ -35,6 +35,11 @@ class OrphanedMetadataFix : public Fix {
   );
   operator std::string() const { return to_string(); };
   void fix();
+  void encode(Encoder& out) const;
+  bool recheck(Database& metadata) const;
+  static std::shared_ptr<Fix> decode(
+      const std::filesystem::path& root, Decoder& in
+  );
 };
 
 class OrphanedMetadataCheck : public Check {
@@ -42,8 +47,10 @@ class OrphanedMetadataCheck : public Check {
   virtual bool do_check() override;
 
  public:
-  OrphanedMetadataCheck(const std::filesystem::path& path)
-      : Check("orphaned metadata", NONFATAL, path) {}
+  OrphanedMetadataCheck(
+      const std::filesystem::path& path, const Options& opts
+  )
+      : Check("orphaned metadata", NONFATAL, path, opts) {}
   virtual ~OrphanedMetadataCheck() override {}
 };
 
@@ -9,15 +9,74 @@
 
 #include "orphaned_objects.h"
 
+#include <unistd.h>
+
 #include <algorithm>
 #include <boost/algorithm/string.hpp>
 #include <boost/range/iterator_range.hpp>
 #include <filesystem>
 #include <iostream>
+#include <iterator>
 #include <stack>
 
+#include "index_assist.h"
+#include "trace.h"
+
+/* Is Referenced - Looks up the metadata for the object or multipart part
+ * named stem in the UUID directory uuid. Multipart uploads are looked up in
+ * the table named multiparts, which may be a copy (see index_assist.h).
+ */
+static bool is_referenced(
+    Database& metadata, OrphanedObjectsFix::Type type, const std::string& uuid,
+    const std::string& stem, const std::string& multiparts = "multiparts"
+) {
+  // stem is bound as text; SQLite applies the integer affinity of the id
+  // columns before comparing, and this way huge numbers can't overflow.
+  switch (type) {
+    case OrphanedObjectsFix::OBJECT:
+      return metadata.count(
+                 "SELECT COUNT(*) FROM versioned_objects "
+                 "WHERE object_id = ? AND id = ?",
+                 uuid, stem
+             ) > 0;
+    case OrphanedObjectsFix::MULTIPART:
+      return metadata.count(
+                 "SELECT COUNT(multiparts_parts.id) FROM multiparts_parts, " +
+                     multiparts + " AS multiparts "
+                     "WHERE multiparts_parts.upload_id = multiparts.upload_id "
+                     "AND multiparts_parts.id = ? AND "
+                     "    multiparts.path_uuid = ?",
+                 stem, uuid
+             ) > 0;
+    case OrphanedObjectsFix::UNKNOWN:
+      break;
+  }
+  return false;
+}
+
+/* Remove - Deletes the file, and any directories above it left empty. Used
+ * when replaying a purge from a journal, so not worth doing in bulk.
+ */
+void OrphanedObjectsFix::remove() {
+  std::filesystem::remove(root_path / obj_path);
+  Log::log("  Deleted " + obj_path.string());
+  std::filesystem::path parent(root_path / obj_path.parent_path());
+  std::error_code ec;
+  while (parent != root_path && std::filesystem::remove(parent, ec)) {
+    parent = parent.parent_path();
+  }
+}
+
 void OrphanedObjectsFix::fix() {
+  if (purge && batch) {
+    batch->add(obj_path);
+    return;
+  }
   try {
+    if (purge) {
+      remove();
+      return;
+    }
     if (!std::filesystem::exists(
             root_path / "lost+found" / obj_path.parent_path()
         )) {
@@ -31,10 +90,12 @@ void OrphanedObjectsFix::fix() {
     );
     Log::log("  Moved " + obj_path.string() + " to lost+found");
 
-    // remove directories above if no object remains
+    // remove directories above if no object remains (this relies on
+    // remove() failing for non-empty directories rather than testing first,
+    // so it's safe when fixes are applied in parallel)
     std::filesystem::path parent(root_path / obj_path.parent_path());
-    while (parent != root_path && is_empty(parent)) {
-      std::filesystem::remove(parent);
+    std::error_code ec;
+    while (parent != root_path && std::filesystem::remove(parent, ec)) {
       parent = parent.parent_path();
     }
   } catch (std::filesystem::filesystem_error& ex) {
@@ -43,6 +104,38 @@ void OrphanedObjectsFix::fix() {
   }
 }
 
+void OrphanedObjectsFix::encode(Encoder& out) const {
+  out.put_u8(ORPHANED_OBJECTS);
+  out.put_u8(type);
+  out.put_string(obj_path.string());
+  out.put_u8(purge);
+}
+
+std::shared_ptr<Fix> OrphanedObjectsFix::decode(
+    const std::filesystem::path& root, Decoder& in
+) {
+  uint8_t type = in.get_u8();
+  if (type > UNKNOWN) {
+    throw std::runtime_error("Unknown orphaned object type in record");
+  }
+  std::string obj_path = in.get_string();
+  // Records from before --purge existed end here
+  bool purge = !in.at_end() && in.get_u8() != 0;
+  return std::make_shared<OrphanedObjectsFix>(
+      static_cast<Type>(type), root, obj_path, purge
+  );
+}
+
+bool OrphanedObjectsFix::recheck(Database& metadata) const {
+  if (!std::filesystem::is_regular_file(root_path / obj_path)) {
+    // Already moved to lost+found (or deleted)
+    return false;
+  }
+  std::string uuid = obj_path.parent_path().string();
+  boost::erase_all(uuid, "/");
+  return !is_referenced(metadata, type, uuid, obj_path.stem());
+}
+
 std::string OrphanedObjectsFix::to_string() const {
   std::string msg("Found ");
   switch (type) {
@@ -60,31 +153,98 @@ std::string OrphanedObjectsFix::to_string() const {
   return msg;
 }
 
+bool OrphanedObjectsCheck::confirm_fixes() {
+  if (!options.purge || options.assume_yes) {
+    return true;
+  }
+  if (!isatty(STDIN_FILENO)) {
+    Log::log("  Not deleting orphaned files without --yes");
+    return false;
+  }
+  std::cout << "  Permanently delete " << fixes.size() << " files? [y/N] "
+            << std::flush;
+  std::string answer;
+  std::getline(std::cin, answer);
+  if (answer == "y" || answer == "Y" || answer == "yes") {
+    return true;
+  }
+  Log::log("  Not deleting orphaned files");
+  return false;
+}
+
+void OrphanedObjectsCheck::finish_fixes() {
+  if (purge) {
+    purge->run();
+  }
+}
+
 bool OrphanedObjectsCheck::do_check() {
   int orphan_count = 0;
+  // Every multipart part found is looked up by its upload
+  IndexAssist assist(*metadata);
+  std::string multiparts =
+      assist.table("multiparts", {"upload_id", "path_uuid"});
+  if (options.purge) {
+    purge = std::make_shared<Purge>(
+        root_path, options.queue_depth, options.throttle
+    );
+  }
   std::stack<std::filesystem::path> stack;
 
-  for (auto& entry : std::filesystem::directory_iterator{root_path}) {
-    // ignore lost+found
-    if (entry.path().filename().string().compare("lost+found") == 0) {
-      continue;
+  if (!options.bucket_id.empty()) {
+    // Only walk the UUID directories of the bucket's objects and multipart
+    // uploads, rather than the whole store
+    Statement& stm = metadata->query(
+        "SELECT uuid FROM objects WHERE bucket_id = ?1 "
+        "UNION SELECT path_uuid FROM multiparts WHERE bucket_id = ?1",
+        options.bucket_id
+    );
+    for (Row row : stm) {
+      std::string_view uuid = row.text(0);
+      std::filesystem::path dir(root_path / uuid_path(uuid));
+      if (uuid.size() > 4 && std::filesystem::is_directory(dir)) {
+        stack.push(dir);
+      }
     }
+  } else {
+    IoToken token(options.throttle);
+    for (auto& entry : std::filesystem::directory_iterator{root_path}) {
+      // ignore lost+found
+      if (entry.path().filename().string().compare("lost+found") == 0) {
+        continue;
+      }
 
-    if (std::filesystem::is_directory(entry.path())) {
-      stack.push(entry.path());
+      if (std::filesystem::is_directory(entry.path())) {
+        stack.push(entry.path());
+      }
     }
   }
 
   while (!stack.empty()) {
     std::filesystem::path cwd = stack.top();
     stack.pop();
+    TraceSpan span("visit directory", cwd.native());
 
+    // Only UUID directories (the third level down) hold objects. Creating,
+    // renaming or removing an object updates its directory's mtime, so if
+    // we're limited to recent changes, older UUID directories can't contain
+    // anything new and needn't be listed.
+    if (options.since > 0) {
+      std::filesystem::path rel = std::filesystem::relative(cwd, root_path);
+      if (std::distance(rel.begin(), rel.end()) == 3 &&
+          mtime_ns(cwd) <= options.since) {
+        continue;
+      }
+    }
+
+    // Listing a directory counts as one operation in flight
+    IoToken token(options.throttle);
     for (auto& entry : std::filesystem::directory_iterator{cwd}) {
       if (std::filesystem::is_directory(entry.path())) {
         stack.push(entry.path());
       } else {
         std::filesystem::path rel =
-            std::filesystem::relative(cwd / entry.path(), root_path);
+            std::filesystem::relative(entry.path(), root_path);
 
         Log::log_verbose("Checking file " + rel.string());
 
@@ -97,40 +257,26 @@ bool OrphanedObjectsCheck::do_check() {
         auto name_is_numeric = std::all_of(stem.begin(), stem.end(), ::isdigit);
         if (name_is_numeric && entry.path().extension() == ".v") {
           // It's a versioned object
-          if (metadata->count_in_table(
-                  "versioned_objects",
-                  "object_id=\"" + uuid + "\" AND id=" + stem
-              ) == 0) {
+          if (!is_referenced(
+                  *metadata, OrphanedObjectsFix::OBJECT, uuid, stem
+              )) {
             fixes.emplace_back(std::make_shared<OrphanedObjectsFix>(
-                OrphanedObjectsFix::OBJECT, root_path, rel.string()
+                OrphanedObjectsFix::OBJECT, root_path, rel.string(),
+                options.purge, purge
             ));
             orphan_count++;
           }
         } else if (name_is_numeric && entry.path().extension() == ".p") {
           // It's a multipart part
-          std::string query =
-              "SELECT COUNT(multiparts_parts.id) FROM multiparts_parts, "
-              "multiparts "
-              "WHERE multiparts_parts.upload_id = multiparts.upload_id AND "
-              "      multiparts_parts.id = " +
-              stem +
-              " AND "
-              "      path_uuid = '" +
-              uuid + "'";
-          Statement stm(metadata->handle, query);
-          if (sqlite3_step(stm) == SQLITE_ROW &&
-              sqlite3_column_count(stm) > 0) {
-            int count = sqlite3_column_int(stm, 0);
-            if (count == 0) {
-              fixes.emplace_back(std::make_shared<OrphanedObjectsFix>(
-                  OrphanedObjectsFix::MULTIPART, root_path, rel.string()
-              ));
-              orphan_count++;
-            }
-          } else {
-            // This can't happen ("SELECT COUNT(...)" is _always_ going
-            // to give us one row with one column...)
-            throw std::runtime_error(sqlite3_errmsg(metadata->handle));
+          if (!is_referenced(
+                  *metadata, OrphanedObjectsFix::MULTIPART, uuid, stem,
+                  multiparts
+              )) {
+            fixes.emplace_back(std::make_shared<OrphanedObjectsFix>(
+                OrphanedObjectsFix::MULTIPART, root_path, rel.string(),
+                options.purge, purge
+            ));
+            orphan_count++;
           }
         } else {
           // It's something else (neither versioned object nor multipart part).
@@ -139,7 +285,8 @@ bool OrphanedObjectsCheck::do_check() {
           // object.  No idea how I managed to hit that - it should be really
           // difficult...
           fixes.emplace_back(std::make_shared<OrphanedObjectsFix>(
-              OrphanedObjectsFix::UNKNOWN, root_path, rel.string()
+              OrphanedObjectsFix::UNKNOWN, root_path, rel.string(),
+              options.purge, purge
           ));
           orphan_count++;
         }
@@ -14,7 +14,8 @@
  *
  * The standard fix to finding orphaned objects is to move them into a
  * "lost+found" directory at the root of the volume, where they can be retrieved
- * and reviewed by a system administrator.
+ * and reviewed by a system administrator. With --purge, they're deleted instead
+ * (see purge.h), which gets the space they take back at once.
 */
 
 #ifndef FSCK_SFS_SRC_CHECKS_ORPHANED_OBJECTS_H__
@@ -24,32 +25,50 @@
 #include <memory>
 
 #include "checks.h"
+#include "purge.h"
 
 class OrphanedObjectsFix : public Fix {
  public:
   enum Type { OBJECT, MULTIPART, UNKNOWN };
   OrphanedObjectsFix(
       Type t, const std::filesystem::path& root,
-      const std::filesystem::path& object
+      const std::filesystem::path& object, bool _purge = false,
+      std::shared_ptr<Purge> _batch = nullptr
   )
-      : Fix(root), obj_path(object), type(t) {}
+      : Fix(root), obj_path(object), type(t), purge(_purge), batch(_batch) {}
   operator std::string() const { return to_string(); };
   void fix();
+  void encode(Encoder& out) const;
+  bool modifies_store() const { return true; }
+  bool recheck(Database& metadata) const;
+  static std::shared_ptr<Fix> decode(
+      const std::filesystem::path& root, Decoder& in
+  );
 
  private:
   std::filesystem::path obj_path;  // relative to root_path
   Type type;
+  bool purge;  // delete the file, rather than moving it to lost+found
+  std::shared_ptr<Purge> batch;
   std::string to_string() const;
+  void remove();
 };
 
 class OrphanedObjectsCheck : public Check {
+ private:
+  std::shared_ptr<Purge> purge;
+
  protected:
   virtual bool do_check() override;
+  virtual void finish_fixes() override;
 
  public:
-  OrphanedObjectsCheck(const std::filesystem::path& path)
-      : Check("orphaned objects", NONFATAL, path) {}
+  OrphanedObjectsCheck(
+      const std::filesystem::path& path, const Options& opts
+  )
+      : Check("orphaned objects", NONFATAL, path, opts) {}
   virtual ~OrphanedObjectsCheck() override {}
+  virtual bool confirm_fixes() override;
 };
 
 #endif  // FSCK_SFS_SRC_CHECKS_ORPHANED_OBJECTS_H__
@@ -0,0 +1,73 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ */
+
+#include "index_assist.h"
+
+#include <boost/algorithm/string/join.hpp>
+
+#include "checks.h"
+#include "trace.h"
+
+/* Is Indexed - Whether the plan for a lookup on a single table uses an index
+ * (or the rowid). An automatic index is built afresh every time the query
+ * runs, so is no better than a scan for our purposes.
+ */
+static bool is_indexed(const std::vector<std::string>& plan) {
+  return plan.size() == 1 && plan[0].rfind("SEARCH", 0) == 0 &&
+         plan[0].find("AUTOMATIC") == std::string::npos;
+}
+
+std::string IndexAssist::table(
+    const std::string& table, const std::vector<std::string>& columns
+) {
+  std::string column_list = boost::algorithm::join(columns, ", ");
+  std::string lookup = table + "(" + column_list + ")";
+  auto found = tables.find(lookup);
+  if (found != tables.end()) {
+    return found->second;
+  }
+
+  std::string condition =
+      boost::algorithm::join(columns, " = ? AND ") + " = ?";
+  std::vector<std::string> plan = metadata.explain(
+      "SELECT " + column_list + " FROM " + table + " WHERE " + condition
+  );
+  Log::log_verbose("Query plan for lookups on " + lookup + ":");
+  for (const std::string& step : plan) {
+    Log::log_verbose("  " + step);
+  }
+  if (is_indexed(plan)) {
+    tables[lookup] = table;
+    return table;
+  }
+
+  TraceSpan span("build index", lookup);
+  // The temp schema is private to the connection, and deleted when it
+  // closes. Unlike sfs.db, it can be written even when that's opened
+  // read-only.
+  std::string copy = table + "_by_" + boost::algorithm::join(columns, "_");
+  metadata
+      .query(
+          "CREATE TEMP TABLE " + copy + " AS SELECT " + column_list +
+          " FROM main." + table
+      )
+      .step();
+  metadata
+      .query(
+          "CREATE INDEX temp." + copy + "_idx ON " + copy + "(" +
+          column_list + ")"
+      )
+      .step();
+  Log::log_verbose(
+      "No index for lookups on " + lookup +
+      ", so built one in a temporary table"
+  );
+  tables[lookup] = "temp." + copy;
+  return tables[lookup];
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ *
+ * - - -
+ *
+ * Index Assist
+ * Some checks look up a metadata row for every file they find, and rely on
+ * the s3gw schema having an index to do so. Older schema layouts don't always
+ * have one, which turns every lookup into a full table scan. Before the first
+ * such lookup on a table, this asks SQLite (with EXPLAIN QUERY PLAN) how it
+ * would do it. If not with an index, it copies the columns looked up into a
+ * temporary table of the connection, with a covering index on them, and has
+ * the check look them up there instead. sfs.db itself is never modified.
+ *
+ * The copy is a snapshot, so it's only suitable for checks, not for fixes,
+ * which must see the metadata as it is.
+ */
+
+#ifndef FSCK_SFS_SRC_INDEX_ASSIST_H__
+#define FSCK_SFS_SRC_INDEX_ASSIST_H__
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "sqlite.h"
+
+class IndexAssist {
+ private:
+  Database& metadata;
+  // The table to use for each kind of lookup, keyed by "table(columns)"
+  std::map<std::string, std::string> tables;
+
+ public:
+  IndexAssist(Database& db) : metadata(db) {}
+
+  // Returns the name of the table to use for looking up rows of table by
+  // equality on columns, which the query must only need columns of
+  std::string table(
+      const std::string& table, const std::vector<std::string>& columns
+  );
+};
+
+#endif  // FSCK_SFS_SRC_INDEX_ASSIST_H__
@@ -0,0 +1,33 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ */
+
+#include "io_throttle.h"
+
+bool IoThrottle::try_acquire() {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (tokens == 0) {
+    return false;
+  }
+  tokens--;
+  return true;
+}
+
+void IoThrottle::acquire() {
+  std::unique_lock<std::mutex> lock(mutex);
+  available.wait(lock, [this] { return tokens > 0; });
+  tokens--;
+}
+
+void IoThrottle::release() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    tokens++;
+  }
+  available.notify_one();
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ *
+ * - - -
+ *
+ * IO Throttle
+ * Limits the number of filesystem operations in flight across several
+ * volumes being checked at once, so that together they use the queue depth
+ * a single volume would have, rather than multiplying it. Each operation
+ * holds a token from when it's started until it's completed.
+ *
+ * This covers statx() calls, directory listings and purge deletions. Objects
+ * read by deep checks aren't counted, as they're read from within the
+ * handlers of statx() calls still holding tokens, and there's only ever one
+ * at a time for each volume.
+ */
+
+#ifndef FSCK_SFS_SRC_IO_THROTTLE_H__
+#define FSCK_SFS_SRC_IO_THROTTLE_H__
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+class IoThrottle {
+ private:
+  std::mutex mutex;
+  std::condition_variable available;
+  unsigned tokens;
+
+ public:
+  IoThrottle(unsigned limit) : tokens(limit) {}
+  IoThrottle(const IoThrottle&) = delete;
+  IoThrottle& operator=(const IoThrottle&) = delete;
+
+  bool try_acquire();
+  // Blocks until a token is available. Callers must not hold any tokens for
+  // operations only they can complete, or this can deadlock.
+  void acquire();
+  void release();
+};
+
+/* IO Token - Holds a token from throttle (if any) for as long as it exists.
+ */
+class IoToken {
+ private:
+  IoThrottle* throttle;
+
+ public:
+  IoToken(const std::shared_ptr<IoThrottle>& t) : throttle(t.get()) {
+    if (throttle) {
+      throttle->acquire();
+    }
+  }
+  IoToken(const IoToken&) = delete;
+  IoToken& operator=(const IoToken&) = delete;
+  ~IoToken() {
+    if (throttle) {
+      throttle->release();
+    }
+  }
+};
+
+#endif  // FSCK_SFS_SRC_IO_THROTTLE_H__
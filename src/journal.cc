@@ -0,0 +1,232 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ */
+
+#include "journal.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+constexpr std::string_view JOURNAL_MAGIC = "fsck.sfs journal 1";
+
+enum Entry : uint8_t {
+  FIXING = 1,
+  PLAN = 2,
+  DONE = 3,
+  COMPLETED = 4,
+  SCOPE = 5
+};
+
+static std::runtime_error journal_error(
+    const std::filesystem::path& path, const std::string& what
+) {
+  return std::runtime_error(
+      what + " " + path.string() + ": " + std::strerror(errno)
+  );
+}
+
+FixJournal::FixJournal(
+    const std::filesystem::path& root, const std::string& _scope
+)
+    : root_path(root),
+      scope(_scope),
+      journal_path(root / JOURNAL_FILENAME),
+      next_id(1) {
+  fd = open(
+      journal_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644
+  );
+  if (fd < 0) {
+    throw journal_error(journal_path, "Unable to open");
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size == 0) {
+    std::string header = frame(std::string(JOURNAL_MAGIC));
+    if (write(fd, header.data(), header.size()) != ssize_t(header.size())) {
+      throw journal_error(journal_path, "Unable to write");
+    }
+    write_scope();
+    sync();
+    // Make sure the journal itself survives a crash, not just its contents
+    int dir_fd = open(root_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+      fsync(dir_fd);
+      close(dir_fd);
+    }
+  }
+}
+
+FixJournal::~FixJournal() {
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+bool FixJournal::exists(const std::filesystem::path& root) {
+  return std::filesystem::exists(root / JOURNAL_FILENAME);
+}
+
+bool FixJournal::load(
+    std::vector<Pending>& pending, std::map<std::string, bool>& completed
+) {
+  std::ifstream in(journal_path, std::ios::binary);
+  std::string payload;
+  if (!read_frame(in, payload) || payload != JOURNAL_MAGIC) {
+    throw std::runtime_error(
+        journal_path.string() + " is not a fsck.sfs fix journal"
+    );
+  }
+  std::streamoff good_size = in.tellg();
+
+  std::map<uint64_t, std::shared_ptr<Fix>> planned;
+  std::string fixing;
+  // Journals are always started with their scope, so this is only left
+  // unknown by a journal from before scopes were recorded
+  std::optional<std::string> run_scope;
+  while (read_frame(in, payload)) {
+    good_size = in.tellg();
+    Decoder entry(payload);
+    switch (entry.get_u8()) {
+      case FIXING:
+        fixing = entry.get_string();
+        break;
+      case PLAN: {
+        uint64_t id = entry.get_varint();
+        planned[id] = decode_fix(root_path, entry);
+        next_id = std::max(next_id, id + 1);
+        break;
+      }
+      case DONE:
+        planned.erase(entry.get_varint());
+        break;
+      case COMPLETED: {
+        std::string check_name = entry.get_string();
+        completed[check_name] = entry.get_u8() != 0;
+        break;
+      }
+      case SCOPE:
+        // Checks completed before a change of scope don't count
+        run_scope = entry.get_string();
+        completed.clear();
+        fixing.clear();
+        break;
+      default:
+        throw std::runtime_error(
+            "Unknown entry in fix journal " + journal_path.string()
+        );
+    }
+  }
+
+  // Drop anything left half-written by the interrupted run, so new entries
+  // follow on from the last intact one.
+  if (ftruncate(fd, good_size) != 0) {
+    throw journal_error(journal_path, "Unable to truncate");
+  }
+
+  for (auto& [id, fix] : planned) {
+    pending.emplace_back(Pending{id, fix});
+  }
+  if (run_scope != scope) {
+    // Fixes are rechecked before being replayed, so are safe to replay
+    // whatever the scope, but the checks must be run again
+    completed.clear();
+    write_scope();
+    return false;
+  }
+  if (!fixing.empty() && completed.count(fixing) == 0) {
+    // The interrupted run had finished checking and was part way through
+    // fixing; once the pending fixes are replayed there's nothing more to do
+    // for this check.
+    completed[fixing] = false;
+    this->completed(fixing, false);
+  }
+  return true;
+}
+
+void FixJournal::write_scope() {
+  Encoder entry;
+  entry.put_u8(SCOPE);
+  entry.put_string(scope);
+  append(entry);
+}
+
+void FixJournal::fixing(const std::string& check_name) {
+  Encoder entry;
+  entry.put_u8(FIXING);
+  entry.put_string(check_name);
+  append(entry);
+}
+
+void FixJournal::append(const Encoder& entry) {
+  std::string data = frame(entry.data());
+  const char* pos = data.data();
+  size_t remaining = data.size();
+  while (remaining > 0) {
+    ssize_t written = write(fd, pos, remaining);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw journal_error(journal_path, "Unable to write");
+    }
+    pos += written;
+    remaining -= written;
+  }
+}
+
+uint64_t FixJournal::plan(const Fix& fix) {
+  if (!fix.modifies_store()) {
+    return 0;
+  }
+  Encoder entry;
+  entry.put_u8(PLAN);
+  entry.put_varint(next_id);
+  fix.encode(entry);
+  append(entry);
+  return next_id++;
+}
+
+void FixJournal::done(uint64_t id) {
+  if (id == 0) {
+    return;
+  }
+  Encoder entry;
+  entry.put_u8(DONE);
+  entry.put_varint(id);
+  append(entry);
+}
+
+void FixJournal::completed(const std::string& check_name, bool passed) {
+  Encoder entry;
+  entry.put_u8(COMPLETED);
+  entry.put_string(check_name);
+  entry.put_u8(passed ? 1 : 0);
+  append(entry);
+  sync();
+}
+
+void FixJournal::sync() {
+  if (fdatasync(fd) != 0) {
+    throw journal_error(journal_path, "Unable to sync");
+  }
+}
+
+void FixJournal::remove() {
+  close(fd);
+  fd = -1;
+  std::filesystem::remove(journal_path);
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ *
+ * - - -
+ *
+ * Fix Journal
+ * A write-ahead log of the fixes applied by a --fix run, kept at the root of
+ * the store. Each check's fixes are recorded (and synced to disk) before any
+ * of them run, and each is marked done afterwards, as is each check once it
+ * completes. If a run is interrupted, the next --fix run replays whatever
+ * fixes weren't marked done, after a cheap recheck of each one, then carries
+ * on with the checks that hadn't completed, rather than starting over. The
+ * journal is removed once a run finishes.
+ *
+ * The journal also records the run's scope (--bucket and --since, plus
+ * --deep and --purge), as a check completed for one bucket or time range, or
+ * without reading objects, says nothing about another. If the next run's
+ * scope differs, pending fixes are still replayed, but every check is run
+ * again.
+ */
+
+#ifndef FSCK_SFS_SRC_JOURNAL_H__
+#define FSCK_SFS_SRC_JOURNAL_H__
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "checks.h"
+#include "serialize.h"
+
+constexpr std::string_view JOURNAL_FILENAME = "fsck.sfs.journal";
+
+class FixJournal {
+ public:
+  struct Pending {
+    uint64_t id;
+    std::shared_ptr<Fix> fix;
+  };
+
+ private:
+  const std::filesystem::path& root_path;
+  const std::string scope;
+  std::filesystem::path journal_path;
+  int fd;
+  uint64_t next_id;
+
+  void append(const Encoder& entry);
+  void write_scope();
+
+ public:
+  // scope identifies the part of the store the run checks
+  FixJournal(const std::filesystem::path& root, const std::string& scope);
+  FixJournal(const FixJournal&) = delete;
+  FixJournal& operator=(const FixJournal&) = delete;
+  ~FixJournal();
+
+  static bool exists(const std::filesystem::path& root);
+
+  // Reads back an interrupted run: fixes not yet marked done, and the checks
+  // that completed (and whether they passed). Must be called before anything
+  // else is written. Returns false if the interrupted run had a different
+  // scope, in which case no checks are reported as completed.
+  bool load(
+      std::vector<Pending>& pending, std::map<std::string, bool>& completed
+  );
+
+  // Records that check_name's fixes are about to be planned and applied
+  void fixing(const std::string& check_name);
+  // Records a fix about to be applied. Returns its id for done(), or zero if
+  // this fix doesn't change anything and so isn't journaled.
+  uint64_t plan(const Fix& fix);
+  void done(uint64_t id);
+  void completed(const std::string& check_name, bool passed);
+  void sync();
+  void remove();
+};
+
+#endif  // FSCK_SFS_SRC_JOURNAL_H__
@@ -17,29 +17,108 @@
  * state even in the event of unrecoverable errors.
 */
 
+#include <time.h>
+
 #include <boost/program_options.hpp>
+#include <climits>
+#include <cstdlib>
 #include <filesystem>
 #include <iostream>
+#include <optional>
+#include <vector>
 
+#include "batch.h"
 #include "checks.h"
+#include "plan.h"
 #include "sqlite.h"
+#include "trace.h"
 
 #define FSCK_ASSERT(condition, message) \
-  if (!condition) {                     \
+  if (!(condition)) {                   \
     std::cerr << message << std::endl;  \
     return 1;                           \
   }
 
+/* Write Trace - Writes out the trace, if --trace was given.
+ */
+static void write_trace(
+    const boost::program_options::variables_map& options_map
+) {
+  if (options_map.count("trace") > 0) {
+    std::filesystem::path trace_path(options_map["trace"].as<std::string>());
+    Trace::write(trace_path);
+    Log::log("Wrote trace to " + trace_path.string());
+  }
+}
+
+/* Parse Since - Parses a --since argument into nanoseconds since the epoch.
+ * Accepts either a number of seconds since the epoch, or a UTC date and time
+ * in the form "YYYY-MM-DD HH:MM:SS" (the time part, and the 'T' separator
+ * from ISO 8601, are optional).
+ */
+static std::optional<int64_t> parse_since(const std::string& str) {
+  char* end = nullptr;
+  long long seconds = std::strtoll(str.c_str(), &end, 10);
+  if (!str.empty() && *end == '\0') {
+    return int64_t(seconds) * 1000000000;
+  }
+  for (const char* format : {"%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S",
+                             "%Y-%m-%d"}) {
+    struct tm tm = {};
+    end = strptime(str.c_str(), format, &tm);
+    if (end != nullptr && *end == '\0') {
+      return int64_t(timegm(&tm)) * 1000000000;
+    }
+  }
+  return std::nullopt;
+}
+
 int main(int argc, char* argv[]) {
   boost::program_options::variables_map options_map;
   try {
     boost::program_options::options_description desc("Allowed Options");
     desc.add_options()("help,h", "print this help text")(
-        "fix,F", "fix any inconsistencies found"
-    )("ignore-uninitialized,I",
-      "don't return an error if the volume is uninitialized")(
-        "path,p", boost::program_options::value<std::string>(), "path to check"
-    )("quiet,q", "run silently")("verbose,v", "more verbose output");
+        "bucket,b", boost::program_options::value<std::string>(),
+        "only check objects in this bucket"
+    )("cache-neutral",
+      "with --deep, don't leave objects read in the page cache (unless "
+      "they were there already)")(
+        "deep,d", "verify object checksums (reads every object)"
+    )("fix,F", "fix any inconsistencies found")(
+        "ignore-uninitialized,I",
+        "don't return an error if the volume is uninitialized"
+    )(
+        "jobs,j", boost::program_options::value<unsigned>(),
+        "number of volumes to check at once (default: one per CPU)"
+    )("path,p", boost::program_options::value<std::vector<std::string>>(),
+      "path(s) to check")(
+        "purge", "with --fix, delete orphaned objects rather than moving them "
+                 "to lost+found"
+    )("queue-depth", boost::program_options::value<std::string>(),
+      "number of filesystem operations to keep in flight at once, or \"auto\" "
+      "to tune it to the storage as we go")(
+        "quiet,q", "run silently"
+    )(
+        "write-plan", boost::program_options::value<std::string>(),
+        "write the fixes found to a plan file, to be applied later"
+    )("apply-plan", boost::program_options::value<std::string>(),
+      "apply the fixes in a plan file, without checking again")(
+        "reverify-days", boost::program_options::value<unsigned>(),
+        "with --deep, verify objects last verified more than this many days "
+        "ago even if unchanged (default 30, 0 to verify every object)"
+    )(
+        "since,s", boost::program_options::value<std::string>(),
+        "only check data modified after this time (seconds since the epoch, "
+        "\"YYYY-MM-DD HH:MM:SS\" UTC, or \"auto\" for the last clean "
+        "shutdown or fsck run)"
+    )("trace", boost::program_options::value<std::string>(),
+      "write a trace of where time was spent to this file, in Chrome trace "
+      "format")("verbose,v", "more verbose output")(
+        "yes,y", "don't ask before fixes that can't be undone"
+    )(
+        "volumes", boost::program_options::value<std::string>(),
+        "check every volume in this directory"
+    );
     // TODO: it's currently possible to specify both quiet and
     // verbose at the same time.  This is a bit ridiculous.
 
@@ -62,30 +141,59 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
-  FSCK_ASSERT(options_map.count("path"), "Must supply path to check");
+  std::vector<std::filesystem::path> volumes;
+  if (options_map.count("path") > 0) {
+    for (const std::string& path :
+         options_map["path"].as<std::vector<std::string>>()) {
+      volumes.emplace_back(path);
+    }
+  }
+  if (options_map.count("volumes") > 0) {
+    std::filesystem::path volumes_dir(options_map["volumes"].as<std::string>());
+    FSCK_ASSERT(
+        std::filesystem::is_directory(volumes_dir),
+        "Volumes directory not found"
+    );
+    std::vector<std::filesystem::path> found = find_volumes(volumes_dir);
+    FSCK_ASSERT(!found.empty(), "No volumes found in " + volumes_dir.string());
+    volumes.insert(volumes.end(), found.begin(), found.end());
+  }
+  FSCK_ASSERT(!volumes.empty(), "Must supply path to check");
+  // Checking more than one volume is done in batch mode (see batch.h)
+  bool batch = volumes.size() > 1 || options_map.count("volumes") > 0;
+  bool ignore_uninitialized = options_map.count("ignore-uninitialized") > 0;
 
-  std::string path_str(options_map["path"].as<std::string>());
-  std::filesystem::path path_root(path_str);
+  std::filesystem::path path_root(volumes.front());
   std::filesystem::path path_database = path_root / DB_FILENAME;
 
-  FSCK_ASSERT(std::filesystem::exists(path_root), "Path not found");
-  FSCK_ASSERT(
-      std::filesystem::is_directory(path_root), "Path must be a directory"
-  );
-
-  if (options_map.count("ignore-uninitialized") > 0) {
-    if (!std::filesystem::exists(path_database)) {
-      return 0;
-    }
-  } else {
+  if (batch) {
+    bool single_volume_only = options_map.count("apply-plan") > 0 ||
+                              options_map.count("write-plan") > 0 ||
+                              options_map.count("bucket") > 0;
     FSCK_ASSERT(
-        std::filesystem::exists(path_database),
-        "Metadata database not found (is this an sfs volume?)"
+        !single_volume_only,
+        "--apply-plan, --write-plan and --bucket only apply to a single volume"
     );
+  } else {
+    FSCK_ASSERT(std::filesystem::exists(path_root), "Path not found");
     FSCK_ASSERT(
-        std::filesystem::is_regular_file(path_database),
-        "Metadata database is not a regular file"
+        std::filesystem::is_directory(path_root), "Path must be a directory"
     );
+
+    if (ignore_uninitialized) {
+      if (!std::filesystem::exists(path_database)) {
+        return 0;
+      }
+    } else {
+      FSCK_ASSERT(
+          std::filesystem::exists(path_database),
+          "Metadata database not found (is this an sfs volume?)"
+      );
+      FSCK_ASSERT(
+          std::filesystem::is_regular_file(path_database),
+          "Metadata database is not a regular file"
+      );
+    }
   }
 
   if (options_map.count("quiet") > 0) {
@@ -95,9 +203,119 @@ int main(int argc, char* argv[]) {
   if (options_map.count("verbose") > 0) {
     Log::level = Log::VERBOSE;
   }
+  if (options_map.count("trace") > 0) {
+    Trace::start();
+  }
+
+  if (options_map.count("apply-plan") > 0) {
+    bool combined = options_map.count("fix") > 0 ||
+                    options_map.count("write-plan") > 0 ||
+                    options_map.count("since") > 0 ||
+                    options_map.count("bucket") > 0;
+    FSCK_ASSERT(
+        !combined,
+        "--apply-plan can't be combined with --fix, --write-plan, --since "
+        "or --bucket"
+    );
+    std::filesystem::path plan_path(
+        options_map["apply-plan"].as<std::string>()
+    );
+    try {
+      bool applied = apply_plan(path_root, plan_path);
+      write_trace(options_map);
+      return applied ? 0 : 1;
+    } catch (std::runtime_error& ex) {
+      std::cerr << "Runtime error: " << ex.what() << std::endl;
+      return 1;
+    }
+  }
+
+  Options options;
+  options.should_fix = options_map.count("fix") > 0;
+  options.purge = options_map.count("purge") > 0;
+  options.assume_yes = options_map.count("yes") > 0;
+  FSCK_ASSERT(
+      !options.purge || options.should_fix, "--purge only applies with --fix"
+  );
+  // Several volumes can't share the terminal to ask
+  FSCK_ASSERT(
+      !(options.purge && batch) || options.assume_yes,
+      "--purge needs --yes when checking several volumes"
+  );
+  options.deep = options_map.count("deep") > 0;
+  options.cache_neutral = options_map.count("cache-neutral") > 0;
+  if (options_map.count("reverify-days") > 0) {
+    options.reverify_days = options_map["reverify-days"].as<unsigned>();
+  }
+  if (options_map.count("queue-depth") > 0) {
+    std::string depth_str(options_map["queue-depth"].as<std::string>());
+    if (depth_str == "auto") {
+      options.queue_depth = AUTO_QUEUE_DEPTH_MAX;
+      options.adaptive_queue_depth = true;
+    } else {
+      char* end = nullptr;
+      unsigned long depth = std::strtoul(depth_str.c_str(), &end, 10);
+      FSCK_ASSERT(
+          !depth_str.empty() && *end == '\0' && depth > 0 && depth <= UINT_MAX,
+          "Queue depth must be a number of at least 1, or \"auto\""
+      );
+      options.queue_depth = depth;
+    }
+  }
+  if (options_map.count("write-plan") > 0) {
+    FSCK_ASSERT(
+        !options.should_fix, "--write-plan can't be combined with --fix"
+    );
+    options.write_plan = options_map["write-plan"].as<std::string>();
+  }
+  bool since_auto = false;
+  if (options_map.count("since") > 0) {
+    std::string since_str(options_map["since"].as<std::string>());
+    if (since_str == "auto" && batch) {
+      // Worked out for each volume as it's checked
+      since_auto = true;
+    } else if (since_str == "auto") {
+      options.since = last_clean_time(path_root);
+      if (options.since == 0) {
+        Log::log(
+            "No record of a clean shutdown or fsck run, checking everything"
+        );
+      }
+    } else {
+      std::optional<int64_t> since = parse_since(since_str);
+      FSCK_ASSERT(since.has_value(), "Unable to parse time: " + since_str);
+      options.since = *since;
+    }
+  }
+
+  if (batch) {
+    unsigned jobs = 0;
+    if (options_map.count("jobs") > 0) {
+      jobs = options_map["jobs"].as<unsigned>();
+      FSCK_ASSERT(jobs > 0, "Jobs must be at least 1");
+    }
+    options.throttle = std::make_shared<IoThrottle>(options.queue_depth);
+    try {
+      bool passed = check_volumes(
+          volumes, options, since_auto, ignore_uninitialized, jobs
+      );
+      write_trace(options_map);
+      return passed ? 0 : 1;
+    } catch (std::runtime_error& ex) {
+      std::cerr << "Runtime error: " << ex.what() << std::endl;
+      return 1;
+    }
+  }
 
   try {
-    return run_checks(path_root, options_map.count("fix") > 0) ? 0 : 1;
+    // This opens the database, so must come after last_clean_time()
+    if (options_map.count("bucket") > 0) {
+      options.bucket = options_map["bucket"].as<std::string>();
+      options.bucket_id = find_bucket(path_root, options.bucket);
+    }
+    bool passed = run_checks(path_root, options);
+    write_trace(options_map);
+    return passed ? 0 : 1;
   } catch (std::runtime_error& ex) {
     std::cerr << "Runtime error: " << ex.what() << std::endl;
     return 1;
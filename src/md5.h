@@ -0,0 +1,46 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ *
+ * - - -
+ *
+ * MD5 (RFC 1321), used to verify object checksums. It's implemented here
+ * rather than pulling in a crypto library just for this.
+ */
+
+#ifndef FSCK_SFS_SRC_MD5_H__
+#define FSCK_SFS_SRC_MD5_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+class Md5 {
+ public:
+  // Per-round shift amounts and constants, shared with the multi-buffer
+  // implementation (see md5_multi.h)
+  static const uint32_t S[64];
+  static const uint32_t K[64];
+
+ private:
+  uint32_t state[4];
+  uint64_t length;
+  unsigned char buffer[64];
+
+ public:
+  Md5();
+  void update(const void* data, size_t size);
+  // Returns the digest as lower case hex. Only call this once.
+  std::string hex_digest();
+
+  // Processes one 64 byte block
+  static void transform(uint32_t state[4], const unsigned char block[64]);
+  // Formats a final state as a lower case hex digest
+  static std::string hex(const uint32_t state[4]);
+};
+
+#endif  // FSCK_SFS_SRC_MD5_H__
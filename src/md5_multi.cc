@@ -0,0 +1,300 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ */
+
+#include "md5_multi.h"
+
+#include <cstdint>
+#include <cstring>
+#include <utility>
+
+#include "md5.h"
+#include "trace.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define FSCK_SFS_MD5_MULTI_X86 1
+#endif
+
+constexpr size_t MAX_LANES = 16;
+
+// Transforms one block in each lane. state holds the a, b, c and d words of
+// every lane in turn (a for lanes 0..n, then b, ...), and words likewise
+// holds each of the 16 message words for every lane in turn.
+using LaneTransform = void (*)(uint32_t* state, const uint32_t* words);
+
+#ifdef FSCK_SFS_MD5_MULTI_X86
+
+__attribute__((target("avx2"))) static void transform_avx2(
+    uint32_t* state, const uint32_t* words
+) {
+  const __m256i ones = _mm256_set1_epi32(-1);
+  __m256i a = _mm256_loadu_si256(reinterpret_cast<__m256i*>(state));
+  __m256i b = _mm256_loadu_si256(reinterpret_cast<__m256i*>(state + 8));
+  __m256i c = _mm256_loadu_si256(reinterpret_cast<__m256i*>(state + 16));
+  __m256i d = _mm256_loadu_si256(reinterpret_cast<__m256i*>(state + 24));
+  __m256i a0 = a, b0 = b, c0 = c, d0 = d;
+  for (int i = 0; i < 64; i++) {
+    __m256i f;
+    int g;
+    if (i < 16) {
+      f = _mm256_or_si256(_mm256_and_si256(b, c), _mm256_andnot_si256(b, d));
+      g = i;
+    } else if (i < 32) {
+      f = _mm256_or_si256(_mm256_and_si256(d, b), _mm256_andnot_si256(d, c));
+      g = (5 * i + 1) % 16;
+    } else if (i < 48) {
+      f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+      g = (3 * i + 5) % 16;
+    } else {
+      f = _mm256_xor_si256(c, _mm256_or_si256(b, _mm256_xor_si256(d, ones)));
+      g = (7 * i) % 16;
+    }
+    __m256i m =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(words + g * 8));
+    __m256i x = _mm256_add_epi32(
+        _mm256_add_epi32(a, f),
+        _mm256_add_epi32(_mm256_set1_epi32(Md5::K[i]), m)
+    );
+    x = _mm256_or_si256(
+        _mm256_sll_epi32(x, _mm_cvtsi32_si128(Md5::S[i])),
+        _mm256_srl_epi32(x, _mm_cvtsi32_si128(32 - Md5::S[i]))
+    );
+    __m256i tmp = d;
+    d = c;
+    c = b;
+    b = _mm256_add_epi32(b, x);
+    a = tmp;
+  }
+  _mm256_storeu_si256(
+      reinterpret_cast<__m256i*>(state), _mm256_add_epi32(a, a0)
+  );
+  _mm256_storeu_si256(
+      reinterpret_cast<__m256i*>(state + 8), _mm256_add_epi32(b, b0)
+  );
+  _mm256_storeu_si256(
+      reinterpret_cast<__m256i*>(state + 16), _mm256_add_epi32(c, c0)
+  );
+  _mm256_storeu_si256(
+      reinterpret_cast<__m256i*>(state + 24), _mm256_add_epi32(d, d0)
+  );
+}
+
+__attribute__((target("avx512f"))) static void transform_avx512(
+    uint32_t* state, const uint32_t* words
+) {
+  __m512i a = _mm512_loadu_si512(state);
+  __m512i b = _mm512_loadu_si512(state + 16);
+  __m512i c = _mm512_loadu_si512(state + 32);
+  __m512i d = _mm512_loadu_si512(state + 48);
+  __m512i a0 = a, b0 = b, c0 = c, d0 = d;
+  for (int i = 0; i < 64; i++) {
+    // Each round function is a single ternary logic op on (b, c, d)
+    __m512i f;
+    int g;
+    if (i < 16) {
+      f = _mm512_ternarylogic_epi32(b, c, d, 0xca);  // b ? c : d
+      g = i;
+    } else if (i < 32) {
+      f = _mm512_ternarylogic_epi32(b, c, d, 0xe4);  // d ? b : c
+      g = (5 * i + 1) % 16;
+    } else if (i < 48) {
+      f = _mm512_ternarylogic_epi32(b, c, d, 0x96);  // b ^ c ^ d
+      g = (3 * i + 5) % 16;
+    } else {
+      f = _mm512_ternarylogic_epi32(b, c, d, 0x39);  // c ^ (b | ~d)
+      g = (7 * i) % 16;
+    }
+    __m512i m = _mm512_loadu_si512(words + g * 16);
+    __m512i x = _mm512_add_epi32(
+        _mm512_add_epi32(a, f),
+        _mm512_add_epi32(_mm512_set1_epi32(Md5::K[i]), m)
+    );
+    // (The masked form, with every lane selected, avoids a spurious
+    // uninitialized variable warning from some GCC versions' headers)
+    x = _mm512_mask_rolv_epi32(x, 0xffff, x, _mm512_set1_epi32(Md5::S[i]));
+    __m512i tmp = d;
+    d = c;
+    c = b;
+    b = _mm512_add_epi32(b, x);
+    a = tmp;
+  }
+  _mm512_storeu_si512(state, _mm512_add_epi32(a, a0));
+  _mm512_storeu_si512(state + 16, _mm512_add_epi32(b, b0));
+  _mm512_storeu_si512(state + 32, _mm512_add_epi32(c, c0));
+  _mm512_storeu_si512(state + 48, _mm512_add_epi32(d, d0));
+}
+
+#endif  // FSCK_SFS_MD5_MULTI_X86
+
+struct Md5Backend {
+  const char* name;
+  size_t lanes;  // zero for the scalar fallback
+  LaneTransform transform;
+};
+
+static Md5Backend select_backend() {
+#ifdef FSCK_SFS_MD5_MULTI_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return {"avx512", 16, transform_avx512};
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return {"avx2", 8, transform_avx2};
+  }
+#endif
+  return {"scalar", 0, nullptr};
+}
+
+static const Md5Backend& backend() {
+  static const Md5Backend selected = select_backend();
+  return selected;
+}
+
+const char* md5_multi_backend() { return backend().name; }
+
+/* Lane - The message being hashed in one lane. Whole blocks are read straight
+ * from the message; the padded final block or two are built in tail.
+ */
+struct Lane {
+  size_t message;
+  const unsigned char* data;
+  size_t whole_blocks;
+  size_t blocks;  // including those in tail
+  size_t next_block;
+  unsigned char tail[128];
+
+  void load(size_t index, std::string_view msg) {
+    message = index;
+    data = reinterpret_cast<const unsigned char*>(msg.data());
+    whole_blocks = msg.size() / 64;
+    size_t remainder = msg.size() % 64;
+    std::memset(tail, 0, sizeof(tail));
+    std::memcpy(tail, data + whole_blocks * 64, remainder);
+    tail[remainder] = 0x80;
+    size_t tail_size = remainder < 56 ? 64 : 128;
+    uint64_t bits = uint64_t(msg.size()) * 8;
+    for (int i = 0; i < 8; i++) {
+      tail[tail_size - 8 + i] = static_cast<unsigned char>(bits >> (i * 8));
+    }
+    blocks = whole_blocks + tail_size / 64;
+    next_block = 0;
+  }
+
+  const unsigned char* block() const {
+    if (next_block < whole_blocks) {
+      return data + next_block * 64;
+    }
+    return tail + (next_block - whole_blocks) * 64;
+  }
+};
+
+/* Hash Lanes - Hashes messages using a SIMD backend, keeping every lane busy
+ * until there are no messages left to start.
+ */
+static std::vector<std::string> hash_lanes(
+    const std::vector<std::string_view>& messages, const Md5Backend& impl
+) {
+  static const unsigned char idle_block[64] = {};
+  static const uint32_t initial[4] = {
+      0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+  const size_t lanes = impl.lanes;
+  std::vector<std::string> digests(messages.size());
+  Lane lane[MAX_LANES];
+  bool busy[MAX_LANES] = {};
+  uint32_t state[4 * MAX_LANES] = {};
+  uint32_t words[16 * MAX_LANES];
+
+  size_t next_message = 0;
+  size_t active = 0;
+  // Starts the next message in lane k, if there is one
+  auto fill = [&](size_t k) {
+    busy[k] = next_message < messages.size();
+    if (!busy[k]) {
+      return;
+    }
+    lane[k].load(next_message, messages[next_message]);
+    next_message++;
+    for (size_t w = 0; w < 4; w++) {
+      state[w * lanes + k] = initial[w];
+    }
+    active++;
+  };
+  for (size_t k = 0; k < lanes; k++) {
+    fill(k);
+  }
+
+  while (active > 0) {
+    // Transpose the next block of each lane, so that each vector the kernel
+    // loads holds the same message word from every lane. Idle lanes hash
+    // zeros, and their results are ignored.
+    for (size_t k = 0; k < lanes; k++) {
+      const unsigned char* block = busy[k] ? lane[k].block() : idle_block;
+      for (size_t j = 0; j < 16; j++) {
+        uint32_t word;
+        std::memcpy(&word, block + j * 4, sizeof(word));  // little endian
+        words[j * lanes + k] = word;
+      }
+    }
+    impl.transform(state, words);
+    for (size_t k = 0; k < lanes; k++) {
+      if (!busy[k] || ++lane[k].next_block < lane[k].blocks) {
+        continue;
+      }
+      uint32_t final_state[4];
+      for (size_t w = 0; w < 4; w++) {
+        final_state[w] = state[w * lanes + k];
+      }
+      digests[lane[k].message] = Md5::hex(final_state);
+      active--;
+      fill(k);
+    }
+  }
+  return digests;
+}
+
+std::vector<std::string> md5_hex_digests(
+    const std::vector<std::string_view>& messages
+) {
+  const Md5Backend& impl = backend();
+  if (impl.lanes > 0 && messages.size() > 1) {
+    return hash_lanes(messages, impl);
+  }
+  std::vector<std::string> digests;
+  digests.reserve(messages.size());
+  for (std::string_view message : messages) {
+    Md5 md5;
+    md5.update(message.data(), message.size());
+    digests.push_back(md5.hex_digest());
+  }
+  return digests;
+}
+
+void Md5Queue::add(std::string data, Callback done) {
+  queued_size += data.size();
+  messages.push_back(std::move(data));
+  callbacks.push_back(std::move(done));
+  if (queued_size >= MD5_QUEUE_SIZE) {
+    flush();
+  }
+}
+
+void Md5Queue::flush() {
+  // Swap the queue out first, so we're left empty even if a callback throws
+  std::vector<std::string> hashing;
+  std::vector<Callback> done;
+  hashing.swap(messages);
+  done.swap(callbacks);
+  queued_size = 0;
+  TraceSpan span("hash objects", md5_multi_backend());
+  std::vector<std::string_view> views(hashing.begin(), hashing.end());
+  std::vector<std::string> digests = md5_hex_digests(views);
+  for (size_t i = 0; i < done.size(); i++) {
+    done[i](digests[i]);
+  }
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ *
+ * - - -
+ *
+ * Multi-buffer MD5
+ * MD5 is inherently serial within a message, so hashing one small object at
+ * a time leaves most of the CPU's SIMD width unused. This hashes several
+ * independent messages at once instead, one per SIMD lane: 16 with AVX-512,
+ * or 8 with AVX2, chosen at runtime according to what the CPU supports. As
+ * each message finishes, its lane is refilled with the next one. Without
+ * either, messages are just hashed one at a time.
+ *
+ * Md5Queue collects small objects read into memory, and hashes them in bulk
+ * once enough have been queued.
+ */
+
+#ifndef FSCK_SFS_SRC_MD5_MULTI_H__
+#define FSCK_SFS_SRC_MD5_MULTI_H__
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Objects up to this size are worth queueing to be hashed in bulk
+constexpr size_t MD5_QUEUE_OBJECT_SIZE = 256 * 1024;
+// Queued data is hashed once there's this much of it
+constexpr size_t MD5_QUEUE_SIZE = 16 * 1024 * 1024;
+
+// Returns the lower case hex MD5 digest of each message
+std::vector<std::string> md5_hex_digests(
+    const std::vector<std::string_view>& messages
+);
+// Names the implementation md5_hex_digests() uses on this CPU
+const char* md5_multi_backend();
+
+class Md5Queue {
+ public:
+  using Callback = std::function<void(const std::string& digest)>;
+
+ private:
+  std::vector<std::string> messages;
+  std::vector<Callback> callbacks;
+  size_t queued_size;
+
+ public:
+  Md5Queue() : queued_size(0) {}
+  // Queues data to be hashed. done is called with its digest, either from
+  // here or from flush().
+  void add(std::string data, Callback done);
+  // Hashes everything queued so far
+  void flush();
+};
+
+#endif  // FSCK_SFS_SRC_MD5_MULTI_H__
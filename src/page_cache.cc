@@ -0,0 +1,82 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ */
+
+#include "page_cache.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+// Only drop once this much has been read since the last time, rather than on
+// every read
+constexpr uint64_t DROP_INTERVAL = 4 * 1024 * 1024;
+
+static uint64_t page_size() {
+  static const uint64_t size = sysconf(_SC_PAGESIZE);
+  return size;
+}
+
+PageCacheGuard::PageCacheGuard(int _fd, uint64_t size, bool _enabled)
+    : fd(_fd), enabled(_enabled), dropped(0), read(0) {
+  if (!enabled || size == 0) {
+    return;
+  }
+  void* map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    // Can't tell, so treat it all as ours to drop
+    return;
+  }
+  resident.resize((size + page_size() - 1) / page_size());
+  if (mincore(map, size, resident.data()) != 0) {
+    resident.clear();
+  }
+  munmap(map, size);
+}
+
+PageCacheGuard::~PageCacheGuard() {
+  if (enabled) {
+    // Include the partial page at the end
+    drop(read + page_size() - 1);
+  }
+}
+
+/* Drop - Drops the pages between dropped and end (rounded down to a page)
+ * that weren't cached before, in as few calls as possible.
+ */
+void PageCacheGuard::drop(uint64_t end) {
+  uint64_t page = dropped / page_size();
+  uint64_t end_page = end / page_size();
+  while (page < end_page) {
+    // Skip pages that were already cached, then find the run that weren't
+    while (page < end_page && page < resident.size() && (resident[page] & 1)) {
+      page++;
+    }
+    uint64_t start = page;
+    while (page < end_page &&
+           (page >= resident.size() || !(resident[page] & 1))) {
+      page++;
+    }
+    if (page > start) {
+      posix_fadvise(
+          fd, start * page_size(), (page - start) * page_size(),
+          POSIX_FADV_DONTNEED
+      );
+    }
+  }
+  dropped = std::max(dropped, end_page * page_size());
+}
+
+void PageCacheGuard::advance(uint64_t offset) {
+  read = std::max(read, offset);
+  if (enabled && read - dropped >= DROP_INTERVAL) {
+    drop(read);
+  }
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ *
+ * - - -
+ *
+ * Page Cache Guard
+ * A deep check reads every object once, which would otherwise push the
+ * gateway's working set out of the page cache. This notes which pages of a
+ * file are already cached before it's read (using mincore() on a mapping of
+ * it, which doesn't fault anything in), and as the read cursor advances,
+ * drops the pages behind it that weren't, with posix_fadvise(DONTNEED).
+ * Pages the gateway had cached are left alone, so they stay hot.
+ */
+
+#ifndef FSCK_SFS_SRC_PAGE_CACHE_H__
+#define FSCK_SFS_SRC_PAGE_CACHE_H__
+
+#include <cstdint>
+#include <vector>
+
+class PageCacheGuard {
+ private:
+  int fd;
+  bool enabled;
+  // Whether each page was cached before we started reading. Pages past the
+  // end of this (if the file grows) count as not cached.
+  std::vector<unsigned char> resident;
+  uint64_t dropped;  // everything before this has been dealt with
+  uint64_t read;     // furthest offset read
+
+  void drop(uint64_t end);
+
+ public:
+  // Does nothing unless enabled, so callers needn't check
+  PageCacheGuard(int fd, uint64_t size, bool enabled);
+  PageCacheGuard(const PageCacheGuard&) = delete;
+  PageCacheGuard& operator=(const PageCacheGuard&) = delete;
+  // Drops whatever's left that we brought in
+  ~PageCacheGuard();
+
+  // Notes that everything before offset has been read
+  void advance(uint64_t offset);
+};
+
+#endif  // FSCK_SFS_SRC_PAGE_CACHE_H__
@@ -0,0 +1,167 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ */
+
+#include "plan.h"
+
+#include <atomic>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "serialize.h"
+#include "thread_pool.h"
+
+constexpr std::string_view PLAN_MAGIC = "fsck.sfs plan 1";
+
+enum Entry : uint8_t { FIX = 1, END = 2 };
+
+PlanWriter::PlanWriter(const std::filesystem::path& path)
+    : plan_path(path), out(path, std::ios::binary | std::ios::trunc) {
+  out << frame(std::string(PLAN_MAGIC));
+  if (!out) {
+    throw std::runtime_error("Unable to write plan " + plan_path.string());
+  }
+}
+
+void PlanWriter::add(const Fix& fix) {
+  Encoder entry;
+  entry.put_u8(FIX);
+  fix.encode(entry);
+  out << frame(entry.data());
+}
+
+void PlanWriter::close() {
+  Encoder entry;
+  entry.put_u8(END);
+  out << frame(entry.data());
+  out.close();
+  if (!out) {
+    throw std::runtime_error("Unable to write plan " + plan_path.string());
+  }
+}
+
+bool apply_plan(
+    const std::filesystem::path& root, const std::filesystem::path& plan_path
+) {
+  std::ifstream in(plan_path, std::ios::binary);
+  std::string payload;
+  if (!read_frame(in, payload) || payload != PLAN_MAGIC) {
+    throw std::runtime_error(plan_path.string() + " is not a fsck.sfs plan");
+  }
+  Log::log("Applying plan " + plan_path.string() + " to " + root.string());
+
+  std::atomic<size_t> applied = 0;
+  std::atomic<size_t> skipped = 0;
+  size_t unfixable = 0;
+  // What's to be reported, per fix in plan order: the lines logged while
+  // applying it, or if it can only be reported, the fix itself, to be
+  // rechecked once everything else has been applied
+  struct Outcome {
+    std::vector<std::string> lines;
+    std::shared_ptr<Fix> unfixable;
+  };
+  struct Batch {
+    std::vector<std::shared_ptr<Fix>> fixes;
+    std::vector<Outcome> outcomes;
+  };
+  // A deque, so batches being applied aren't moved as more are added
+  std::deque<Batch> batches;
+  auto apply_batch = [&](Batch& batch) {
+    // SQLite connections shouldn't be shared between threads, so each batch
+    // gets its own for rechecking.
+    Database metadata(root / DB_FILENAME);
+    for (auto& fix : batch.fixes) {
+      Outcome outcome;
+      if (!fix->modifies_store()) {
+        outcome.unfixable = fix;
+      } else {
+        Log::Hold hold(outcome.lines);
+        if (fix->recheck(metadata)) {
+          fix->fix();
+          applied++;
+        } else {
+          Log::log_verbose("Already fixed: " + std::string(*fix));
+          skipped++;
+        }
+      }
+      if (outcome.unfixable || !outcome.lines.empty()) {
+        batch.outcomes.emplace_back(std::move(outcome));
+      }
+    }
+    batch.fixes.clear();
+  };
+
+  bool complete = false;
+  {
+    // Declared after apply_batch so queued batches finish before it goes away
+    ThreadPool pool;
+    batches.emplace_back();
+    while (!complete && read_frame(in, payload)) {
+      Decoder entry(payload);
+      switch (entry.get_u8()) {
+        case FIX:
+          batches.back().fixes.emplace_back(decode_fix(root, entry));
+          if (batches.back().fixes.size() == PLAN_BATCH_SIZE) {
+            Batch& batch = batches.back();
+            pool.submit([&apply_batch, &batch] { apply_batch(batch); });
+            batches.emplace_back();
+          }
+          break;
+        case END:
+          complete = true;
+          break;
+        default:
+          throw std::runtime_error(
+              "Unknown entry in plan " + plan_path.string()
+          );
+      }
+    }
+    if (!batches.back().fixes.empty()) {
+      Batch& batch = batches.back();
+      pool.submit([&apply_batch, &batch] { apply_batch(batch); });
+    }
+    pool.wait();
+  }
+
+  // Problems that can only be reported may have gone away along with others'
+  // fixes (e.g. orphaned metadata whose rows were deleted as dangling
+  // references), so they're rechecked now everything else has been applied
+  Database metadata(root / DB_FILENAME);
+  for (Batch& batch : batches) {
+    for (Outcome& outcome : batch.outcomes) {
+      for (const std::string& line : outcome.lines) {
+        Log::print(line);
+      }
+      if (!outcome.unfixable) {
+        continue;
+      }
+      if (outcome.unfixable->recheck(metadata)) {
+        Log::log("  " + std::string(*outcome.unfixable));
+        unfixable++;
+      } else {
+        Log::log_verbose("No longer found: " + std::string(*outcome.unfixable));
+        skipped++;
+      }
+    }
+  }
+
+  Log::log(
+      "Applied " + std::to_string(applied) + " fixes, skipped " +
+      std::to_string(skipped) + " no longer needed, " +
+      std::to_string(unfixable) + " can't be fixed automatically."
+  );
+  if (!complete) {
+    Log::log("Plan " + plan_path.string() + " is truncated or corrupt.");
+  }
+  return complete;
+}
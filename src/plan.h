@@ -0,0 +1,50 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ *
+ * - - -
+ *
+ * Fix Plans
+ * A report-only run can write every fix it finds to a plan file with
+ * --write-plan. Once the plan has been reviewed, --apply-plan applies it
+ * without checking the store again: each fix is just rechecked cheaply (for
+ * example a stat and a single indexed lookup) and applied, in parallel
+ * batches. The plan is a stream of framed records (see serialize.h), so it's
+ * never held in memory all at once; only what there is to report is kept,
+ * so that it can be reported in plan order once every batch is done.
+ * Problems that can only be reported are rechecked then too, as applying
+ * other fixes may have made them go away.
+ */
+
+#ifndef FSCK_SFS_SRC_PLAN_H__
+#define FSCK_SFS_SRC_PLAN_H__
+
+#include <filesystem>
+#include <fstream>
+
+#include "checks.h"
+
+// Number of fixes handed to a worker thread at a time by --apply-plan
+constexpr size_t PLAN_BATCH_SIZE = 256;
+
+class PlanWriter {
+ private:
+  std::filesystem::path plan_path;
+  std::ofstream out;
+
+ public:
+  PlanWriter(const std::filesystem::path& path);
+  void add(const Fix& fix);
+  // Marks the plan complete; a plan without this is treated as truncated
+  void close();
+};
+
+bool apply_plan(
+    const std::filesystem::path& root, const std::filesystem::path& plan_path
+);
+
+#endif  // FSCK_SFS_SRC_PLAN_H__
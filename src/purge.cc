@@ -0,0 +1,225 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ */
+
+#include "purge.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iterator>
+#include <set>
+
+#include "checks.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+// Never follow a symlink out of the store
+constexpr int DIR_FLAGS = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+// Directories this shallow (the root and the first level of the UUID
+// fan-out) are kept open for the whole purge. Below that there's usually a
+// directory per orphan, far too many to keep open at once.
+constexpr size_t CACHED_DIR_DEPTH = 1;
+
+static size_t depth(const std::filesystem::path& path) {
+  return std::distance(path.begin(), path.end());
+}
+
+Purge::Purge(
+    const std::filesystem::path& root, unsigned _threads,
+    std::shared_ptr<IoThrottle> _throttle
+)
+    : root_path(root),
+      threads(_threads),
+      throttle(_throttle),
+      deleted(0),
+      failed(0),
+      reclaimed(0) {}
+
+Purge::~Purge() {
+  for (auto& [dir, fd] : dir_fds) {
+    close(fd);
+  }
+}
+
+void Purge::add(const std::filesystem::path& obj_path) {
+  files[obj_path.parent_path()].push_back(obj_path.filename());
+}
+
+/* Open Dir - Returns a new fd for dir (relative to the root), which the
+ * caller must close, opening each directory on the way relative to its
+ * parent. Returns -1, with errno set, on failure.
+ */
+int Purge::open_dir(const std::filesystem::path& dir) {
+  std::filesystem::path current;
+  auto part = dir.begin();
+  int fd;
+  {
+    std::lock_guard<std::mutex> lock(dir_fds_mutex);
+    fd = dir_fds.at(current);
+    for (; part != dir.end() && depth(current) < CACHED_DIR_DEPTH; ++part) {
+      current /= *part;
+      auto found = dir_fds.find(current);
+      if (found != dir_fds.end()) {
+        fd = found->second;
+        continue;
+      }
+      fd = openat(fd, part->c_str(), DIR_FLAGS);
+      if (fd < 0) {
+        return -1;
+      }
+      dir_fds[current] = fd;
+    }
+    fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (fd < 0) {
+      return -1;
+    }
+  }
+  for (; part != dir.end(); ++part) {
+    int child = openat(fd, part->c_str(), DIR_FLAGS);
+    int err = errno;
+    close(fd);
+    if (child < 0) {
+      errno = err;
+      return -1;
+    }
+    fd = child;
+  }
+  return fd;
+}
+
+void Purge::delete_files(
+    const std::filesystem::path& dir, const std::vector<std::string>& names
+) {
+  TraceSpan span("purge directory", dir.native());
+  int fd = open_dir(dir);
+  if (fd < 0) {
+    Log::log(
+        "  Error: unable to open " + dir.string() + ": " + std::strerror(errno)
+    );
+    failed += names.size();
+    return;
+  }
+  for (const std::string& name : names) {
+    if (throttle) {
+      throttle->acquire();
+    }
+    struct stat st;
+    int err = 0;
+    if (fstatat(fd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+        unlinkat(fd, name.c_str(), 0) != 0) {
+      err = errno;
+    }
+    if (throttle) {
+      throttle->release();
+    }
+    std::filesystem::path obj_path(dir / name);
+    if (err == ENOENT) {
+      // Already gone
+      continue;
+    }
+    if (err != 0) {
+      Log::log(
+          "  Error: unable to delete " + obj_path.string() + ": " +
+          std::strerror(err)
+      );
+      failed++;
+      continue;
+    }
+    Log::log_verbose("Deleted " + obj_path.string());
+    deleted++;
+    // Space is only freed when the last link to a file goes
+    if (st.st_nlink == 1) {
+      reclaimed += uint64_t(st.st_blocks) * 512;
+    }
+  }
+  close(fd);
+}
+
+/* Remove Empty Dirs - Removes the directories files were deleted from, and
+ * those above them, that are now empty. Returns how many were removed.
+ */
+uint64_t Purge::remove_empty_dirs() {
+  std::set<std::filesystem::path> dirs;
+  for (auto& entry : files) {
+    for (std::filesystem::path dir = entry.first; !dir.empty();
+         dir = dir.parent_path()) {
+      if (!dirs.insert(dir).second) {
+        break;  // and so are all those above it
+      }
+    }
+  }
+  std::vector<std::filesystem::path> deepest_first(dirs.begin(), dirs.end());
+  std::stable_sort(
+      deepest_first.begin(), deepest_first.end(),
+      [](const std::filesystem::path& a, const std::filesystem::path& b) {
+        return depth(a) > depth(b);
+      }
+  );
+  uint64_t removed = 0;
+  for (const std::filesystem::path& dir : deepest_first) {
+    int parent_fd = open_dir(dir.parent_path());
+    if (parent_fd < 0) {
+      continue;
+    }
+    // Fails harmlessly if the directory isn't empty
+    if (unlinkat(parent_fd, dir.filename().c_str(), AT_REMOVEDIR) == 0) {
+      removed++;
+    }
+    close(parent_fd);
+  }
+  return removed;
+}
+
+void Purge::run() {
+  if (files.empty()) {
+    return;
+  }
+  TraceSpan span("purge");
+  int root_fd = open(root_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (root_fd < 0) {
+    Log::log(
+        "  Error: unable to open " + root_path.string() + ": " +
+        std::strerror(errno)
+    );
+    return;
+  }
+  dir_fds[""] = root_fd;
+
+  {
+    ThreadPool pool(threads);
+    // Log::prefix is per thread, so the pool's threads need it passing on
+    std::string prefix = Log::prefix;
+    for (auto& entry : files) {
+      pool.submit([this, &entry, &prefix] {
+        Log::prefix = prefix;
+        delete_files(entry.first, entry.second);
+      });
+    }
+    pool.wait();
+  }
+  uint64_t removed_dirs = remove_empty_dirs();
+
+  Log::log(
+      "  Purged " + std::to_string(deleted) + " files, reclaiming " +
+      std::to_string(reclaimed) + " bytes"
+  );
+  if (removed_dirs > 0) {
+    Log::log(
+        "  Removed " + std::to_string(removed_dirs) + " empty directories"
+    );
+  }
+  if (failed > 0) {
+    Log::log("  Unable to delete " + std::to_string(failed) + " files");
+  }
+  files.clear();
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ *
+ * - - -
+ *
+ * Purge
+ * Deletes files in bulk, for when the space taken by orphans is needed back
+ * at once rather than them being kept in lost+found. Files are grouped by
+ * directory, and each directory is opened once; its files are then removed
+ * with unlinkat() relative to it, several directories at a time, and it's
+ * closed again. Only the root and the first level of the fan-out stay open
+ * throughout. Directories left empty are then removed in a single pass,
+ * deepest first, so that each parent is only tried once all of its children
+ * have been.
+ */
+
+#ifndef FSCK_SFS_SRC_PURGE_H__
+#define FSCK_SFS_SRC_PURGE_H__
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "io_throttle.h"
+
+class Purge {
+ private:
+  const std::filesystem::path& root_path;
+  const unsigned threads;
+  std::shared_ptr<IoThrottle> throttle;
+  // Files to delete, keyed by directory, all relative to root_path
+  std::map<std::filesystem::path, std::vector<std::string>> files;
+  // Directories kept open, by path relative to root_path (which is "")
+  std::map<std::filesystem::path, int> dir_fds;
+  std::mutex dir_fds_mutex;
+
+  std::atomic<uint64_t> deleted;
+  std::atomic<uint64_t> failed;
+  std::atomic<uint64_t> reclaimed;  // bytes
+
+  int open_dir(const std::filesystem::path& dir);
+  void delete_files(
+      const std::filesystem::path& dir, const std::vector<std::string>& names
+  );
+  uint64_t remove_empty_dirs();
+
+ public:
+  Purge(
+      const std::filesystem::path& root, unsigned threads,
+      std::shared_ptr<IoThrottle> throttle = nullptr
+  );
+  Purge(const Purge&) = delete;
+  Purge& operator=(const Purge&) = delete;
+  ~Purge();
+
+  // Adds obj_path (relative to the root) to the files to delete
+  void add(const std::filesystem::path& obj_path);
+  // Deletes every file added, then the directories they leave empty, and
+  // reports the space reclaimed
+  void run();
+};
+
+#endif  // FSCK_SFS_SRC_PURGE_H__
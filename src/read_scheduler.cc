@@ -0,0 +1,87 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ */
+
+#include "read_scheduler.h"
+
+#include <fcntl.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <tuple>
+#include <utility>
+
+ReadScheduler::ReadScheduler(size_t _batch_size)
+    : batch_size(std::max<size_t>(_batch_size, 1)) {
+  batch.reserve(batch_size);
+}
+
+/* Physical Offset - Returns the physical location on disk of the start of
+ * path, or zero if it can't be determined (no FIEMAP support, or the file
+ * is empty or stored inline).
+ */
+uint64_t ReadScheduler::physical_offset(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOATIME);
+  if (fd < 0) {
+    // O_NOATIME is only permitted for the file's owner (or root)
+    fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  }
+  if (fd < 0) {
+    return 0;
+  }
+  // struct fiemap ends in a flexible array of extents; we only want one
+  alignas(struct fiemap) char
+      buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)] = {};
+  struct fiemap* map = reinterpret_cast<struct fiemap*>(buf);
+  map->fm_length = FIEMAP_MAX_OFFSET;
+  map->fm_extent_count = 1;
+  uint64_t physical = 0;
+  if (ioctl(fd, FS_IOC_FIEMAP, map) == 0 && map->fm_mapped_extents > 0 &&
+      !(map->fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN)) {
+    physical = map->fm_extents[0].fe_physical;
+  }
+  close(fd);
+  return physical;
+}
+
+void ReadScheduler::add(
+    const std::string& path, uint64_t inode, Reader reader
+) {
+  batch.emplace_back(
+      Entry{physical_offset(path), inode, path, std::move(reader)}
+  );
+  if (batch.size() >= batch_size) {
+    flush();
+  }
+}
+
+void ReadScheduler::flush() {
+  std::sort(batch.begin(), batch.end(), [](const Entry& a, const Entry& b) {
+    return std::tie(a.physical, a.inode) < std::tie(b.physical, b.inode);
+  });
+  // Swap the batch out first, so we're left empty even if a reader throws
+  std::vector<Entry> entries;
+  entries.swap(batch);
+  batch.reserve(batch_size);
+  for (Entry& entry : entries) {
+    int fd = open(entry.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      continue;
+    }
+    try {
+      entry.reader(fd);
+    } catch (...) {
+      close(fd);
+      throw;
+    }
+    close(fd);
+  }
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ *
+ * - - -
+ *
+ * Read Scheduler
+ * Reading every object in metadata order means reading them in essentially
+ * random order on disk, which is painfully slow on spinning or thinly
+ * provisioned storage. This collects files to be read in large batches, and
+ * reads each batch in order of physical location on disk, as reported by the
+ * FIEMAP ioctl, falling back to inode number where that isn't available
+ * (inode order usually roughly follows allocation order).
+ */
+
+#ifndef FSCK_SFS_SRC_READ_SCHEDULER_H__
+#define FSCK_SFS_SRC_READ_SCHEDULER_H__
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+constexpr size_t READ_BATCH_SIZE = 4096;
+
+class ReadScheduler {
+ public:
+  // Called with a file descriptor open for reading. Not called if the file
+  // can't be opened (e.g. it's gone away).
+  using Reader = std::function<void(int fd)>;
+
+ private:
+  struct Entry {
+    uint64_t physical;
+    uint64_t inode;
+    std::string path;
+    Reader reader;
+  };
+  std::vector<Entry> batch;
+  const size_t batch_size;
+
+  static uint64_t physical_offset(const std::string& path);
+
+ public:
+  ReadScheduler(size_t batch_size = READ_BATCH_SIZE);
+  // inode may be zero if unknown, in which case only FIEMAP is used
+  void add(const std::string& path, uint64_t inode, Reader reader);
+  // Reads everything added so far
+  void flush();
+};
+
+#endif  // FSCK_SFS_SRC_READ_SCHEDULER_H__
@@ -0,0 +1,472 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ */
+
+#include "salvage.h"
+
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include "sqlite.h"
+#include "trace.h"
+
+constexpr char SQLITE_MAGIC[] = "SQLite format 3";  // and its terminating NUL
+constexpr size_t DB_HEADER_SIZE = 100;
+constexpr uint8_t INTERIOR_TABLE_PAGE = 0x05;
+constexpr uint8_t LEAF_TABLE_PAGE = 0x0d;
+// Deeper than any real b-tree could be, so deeper means a loop
+constexpr unsigned MAX_BTREE_DEPTH = 64;
+
+static uint32_t get_u16(const unsigned char* pos) {
+  return (uint32_t(pos[0]) << 8) | pos[1];
+}
+
+static uint32_t get_u32(const unsigned char* pos) {
+  return (uint32_t(pos[0]) << 24) | (uint32_t(pos[1]) << 16) |
+         (uint32_t(pos[2]) << 8) | pos[3];
+}
+
+/* Get Varint - Reads the variable length integer at pos into value. Returns
+ * the position after it, or nullptr if it runs past end.
+ */
+static const unsigned char* get_varint(
+    const unsigned char* pos, const unsigned char* end, uint64_t& value
+) {
+  value = 0;
+  for (int i = 0; i < 9; i++) {
+    if (pos >= end) {
+      return nullptr;
+    }
+    unsigned char byte = *pos++;
+    if (i == 8) {
+      // The ninth byte contributes all eight bits
+      value = (value << 8) | byte;
+      break;
+    }
+    value = (value << 7) | (byte & 0x7f);
+    if (!(byte & 0x80)) {
+      break;
+    }
+  }
+  return pos;
+}
+
+/* Parse Record - Decodes a record (a row's values) in the record format.
+ * Returns false if it doesn't fit in payload.
+ */
+static bool parse_record(
+    std::string_view payload, std::vector<BtreeReader::Value>& values
+) {
+  const unsigned char* start =
+      reinterpret_cast<const unsigned char*>(payload.data());
+  const unsigned char* end = start + payload.size();
+  uint64_t header_size;
+  const unsigned char* pos = get_varint(start, end, header_size);
+  if (pos == nullptr || header_size > payload.size() ||
+      start + header_size < pos) {
+    return false;
+  }
+  const unsigned char* header_end = start + header_size;
+  const unsigned char* body = header_end;
+  values.clear();
+  while (pos < header_end) {
+    uint64_t serial_type;
+    pos = get_varint(pos, header_end, serial_type);
+    if (pos == nullptr) {
+      return false;
+    }
+    static const size_t integer_sizes[] = {0, 1, 2, 3, 4, 6, 8, 8};
+    BtreeReader::Value value{};
+    size_t size = 0;
+    if (serial_type == 0) {
+      value.type = BtreeReader::Value::NUL;
+    } else if (serial_type <= 7) {
+      size = integer_sizes[serial_type];
+    } else if (serial_type == 8 || serial_type == 9) {
+      value.type = BtreeReader::Value::INTEGER;
+      value.integer = serial_type - 8;
+    } else if (serial_type >= 12) {
+      size = (serial_type - 12) / 2;
+      value.type = serial_type % 2 == 0 ? BtreeReader::Value::BLOB
+                                        : BtreeReader::Value::TEXT;
+    } else {
+      return false;  // reserved
+    }
+    if (size > size_t(end - body)) {
+      return false;
+    }
+    if (serial_type >= 1 && serial_type <= 7) {
+      // Big endian, and for integers, two's complement
+      uint64_t bits = 0;
+      for (size_t i = 0; i < size; i++) {
+        bits = (bits << 8) | body[i];
+      }
+      if (serial_type == 7) {
+        value.type = BtreeReader::Value::REAL;
+        std::memcpy(&value.real, &bits, sizeof(value.real));
+      } else {
+        unsigned shift = 64 - size * 8;
+        value.type = BtreeReader::Value::INTEGER;
+        value.integer = int64_t(bits << shift) >> shift;
+      }
+    } else if (serial_type >= 12) {
+      value.bytes =
+          std::string_view(reinterpret_cast<const char*>(body), size);
+    }
+    body += size;
+    values.push_back(value);
+  }
+  return true;
+}
+
+BtreeReader::BtreeReader(const std::filesystem::path& path)
+    : fd(-1), data(nullptr), size(0), damaged(0) {
+  fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw std::runtime_error(
+        "Unable to open " + path.string() + ": " + std::strerror(errno)
+    );
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || size_t(st.st_size) < DB_HEADER_SIZE) {
+    close(fd);
+    throw std::runtime_error(path.string() + " is not an SQLite database");
+  }
+  size = st.st_size;
+  void* map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    close(fd);
+    throw std::runtime_error(
+        "Unable to map " + path.string() + ": " + std::strerror(errno)
+    );
+  }
+  data = static_cast<const unsigned char*>(map);
+
+  std::string problem;
+  page_size = get_u16(data + 16);
+  if (page_size == 1) {
+    page_size = 65536;
+  }
+  usable_size = page_size - data[20];
+  if (std::memcmp(data, SQLITE_MAGIC, sizeof(SQLITE_MAGIC)) != 0) {
+    problem = path.string() + " is not an SQLite database";
+  } else if (page_size < 512 || page_size > 65536 ||
+             (page_size & (page_size - 1)) != 0 || usable_size < 480) {
+    problem = "The page size in the header of " + path.string() +
+              " is damaged, so it can't be salvaged";
+  } else if (get_u32(data + 56) > 1) {
+    problem = "Only UTF-8 databases can be salvaged";
+  }
+  if (!problem.empty()) {
+    munmap(map, size);
+    close(fd);
+    throw std::runtime_error(problem);
+  }
+  // The page count in the header may be damaged too, and the file's size
+  // is what bounds what can be read
+  page_count = size / page_size;
+}
+
+BtreeReader::~BtreeReader() {
+  munmap(const_cast<unsigned char*>(data), size);
+  close(fd);
+}
+
+const unsigned char* BtreeReader::page(uint32_t number) const {
+  if (number == 0 || number > page_count) {
+    return nullptr;
+  }
+  return data + size_t(number - 1) * page_size;
+}
+
+std::vector<BtreeReader::SchemaEntry> BtreeReader::schema() {
+  std::vector<SchemaEntry> entries;
+  // The schema table's b-tree is rooted at page 1, after the header
+  scan(1, [&](int64_t, const std::vector<Value>& values) {
+    if (values.size() < 5 || values[3].type != Value::INTEGER) {
+      return;
+    }
+    SchemaEntry entry;
+    entry.type = values[0].bytes;
+    entry.name = values[1].bytes;
+    entry.table = values[2].bytes;
+    entry.root = values[3].integer;
+    entry.sql = values[4].bytes;
+    entries.push_back(entry);
+  });
+  return entries;
+}
+
+void BtreeReader::scan(uint32_t root, const RowHandler& handler) {
+  TraceSpan span("salvage table");
+  visited.assign(page_count + 1, false);
+  scan_page(root, 0, handler);
+}
+
+void BtreeReader::scan_page(
+    uint32_t number, unsigned depth, const RowHandler& handler
+) {
+  const unsigned char* start = page(number);
+  if (start == nullptr || depth > MAX_BTREE_DEPTH || visited[number]) {
+    damaged++;
+    return;
+  }
+  visited[number] = true;
+  const unsigned char* header = start + (number == 1 ? DB_HEADER_SIZE : 0);
+  const unsigned char* end = start + usable_size;
+  uint8_t type = header[0];
+  if (type != INTERIOR_TABLE_PAGE && type != LEAF_TABLE_PAGE) {
+    damaged++;
+    return;
+  }
+  uint32_t cells = get_u16(header + 3);
+  const unsigned char* pointers =
+      header + (type == INTERIOR_TABLE_PAGE ? 12 : 8);
+  if (pointers + 2 * cells > end) {
+    damaged++;
+    return;
+  }
+
+  bool intact = true;
+  std::string overflow;
+  std::vector<Value> values;
+  for (uint32_t i = 0; i < cells; i++) {
+    const unsigned char* cell = start + get_u16(pointers + 2 * i);
+    if (cell < pointers + 2 * cells || cell >= end) {
+      intact = false;
+    } else if (type == INTERIOR_TABLE_PAGE) {
+      // Each cell holds a child page number, then its largest rowid
+      if (cell + 4 > end) {
+        intact = false;
+      } else {
+        scan_page(get_u32(cell), depth + 1, handler);
+      }
+    } else if (!read_cell(cell, end, overflow, values, handler)) {
+      intact = false;
+    }
+  }
+  if (type == INTERIOR_TABLE_PAGE) {
+    scan_page(get_u32(header + 8), depth + 1, handler);
+  }
+  if (!intact) {
+    damaged++;
+  }
+}
+
+/* Read Cell - Reads the row in a table leaf cell, following its overflow
+ * pages if it has any, and passes it to handler. Returns false if the cell
+ * is damaged.
+ */
+bool BtreeReader::read_cell(
+    const unsigned char* cell, const unsigned char* page_end,
+    std::string& overflow, std::vector<Value>& values,
+    const RowHandler& handler
+) {
+  uint64_t payload_size;
+  uint64_t rowid;
+  const unsigned char* pos = get_varint(cell, page_end, payload_size);
+  if (pos == nullptr || payload_size > size) {
+    return false;
+  }
+  pos = get_varint(pos, page_end, rowid);
+  if (pos == nullptr) {
+    return false;
+  }
+  // How much of the payload is on this page, the rest being in a chain of
+  // overflow pages (see "Cell Payload Overflow Pages" in the format)
+  uint64_t usable = usable_size;
+  uint64_t max_local = usable - 35;
+  uint64_t local = payload_size;
+  if (payload_size > max_local) {
+    uint64_t min_local = (usable - 12) * 32 / 255 - 23;
+    uint64_t k = min_local + (payload_size - min_local) % (usable - 4);
+    local = k <= max_local ? k : min_local;
+  }
+  if (local > uint64_t(page_end - pos)) {
+    return false;
+  }
+  std::string_view payload(reinterpret_cast<const char*>(pos), local);
+  if (local < payload_size) {
+    if (local + 4 > uint64_t(page_end - pos)) {
+      return false;
+    }
+    overflow.assign(payload);
+    uint32_t next = get_u32(pos + local);
+    for (uint32_t pages = 0; overflow.size() < payload_size; pages++) {
+      const unsigned char* overflow_page = page(next);
+      if (overflow_page == nullptr || pages >= page_count) {
+        return false;
+      }
+      // Each overflow page starts with the number of the next
+      size_t part = std::min<uint64_t>(
+          payload_size - overflow.size(), usable_size - 4
+      );
+      overflow.append(
+          reinterpret_cast<const char*>(overflow_page + 4), part
+      );
+      next = get_u32(overflow_page);
+    }
+    payload = overflow;
+  }
+  if (!parse_record(payload, values)) {
+    return false;
+  }
+  handler(int64_t(rowid), values);
+  return true;
+}
+
+SalvagedMetadata::SalvagedMetadata(
+    const std::filesystem::path& damaged, const std::vector<std::string>& tables
+)
+    : rows(0), damaged_pages(0) {
+  TraceSpan span("salvage metadata");
+  BtreeReader reader(damaged);
+  std::vector<BtreeReader::SchemaEntry> schema = reader.schema();
+
+  std::string tmp_path(
+      (std::filesystem::temp_directory_path() / "fsck.sfs.salvage.XXXXXX")
+          .string()
+  );
+  int fd = mkstemp(tmp_path.data());
+  if (fd < 0) {
+    throw std::runtime_error(
+        std::string("Unable to create temporary database: ") +
+        std::strerror(errno)
+    );
+  }
+  close(fd);
+  db_path = tmp_path;
+
+  try {
+    Database salvaged(db_path);
+    Statement& journal_mode = salvaged.query("PRAGMA journal_mode = OFF");
+    journal_mode.step();
+    journal_mode.reset();
+    salvaged.query("PRAGMA synchronous = OFF").step();
+
+    std::vector<std::string> copied;
+    for (const std::string& table : tables) {
+      auto entry = std::find_if(
+          schema.begin(), schema.end(),
+          [&](const BtreeReader::SchemaEntry& e) {
+            return e.type == "table" && e.name == table;
+          }
+      );
+      // Tables without rowids are stored differently, and s3gw doesn't
+      // use them
+      if (entry == schema.end() ||
+          entry->sql.find("WITHOUT ROWID") != std::string::npos) {
+        missing.push_back(table);
+        continue;
+      }
+      salvaged.query(entry->sql).step();
+      copied.push_back(table);
+
+      // An INTEGER PRIMARY KEY column is an alias for the rowid, and is
+      // stored as that, with a NULL in its place in the record
+      std::vector<std::string> columns;
+      int primary_keys = 0;
+      size_t rowid_column = SIZE_MAX;
+      for (Row row : salvaged.query("PRAGMA table_info(" + table + ")")) {
+        if (row.int64(5) > 0) {
+          primary_keys++;
+          if (strcasecmp(std::string(row.text(2)).c_str(), "INTEGER") == 0) {
+            rowid_column = columns.size();
+          }
+        }
+        columns.emplace_back(row.text(1));
+      }
+      if (primary_keys != 1) {
+        rowid_column = SIZE_MAX;
+      }
+
+      salvaged.query("BEGIN").step();
+      reader.scan(
+          entry->root,
+          [&](int64_t rowid, const std::vector<BtreeReader::Value>& values) {
+            // Rows written before a column was added are short of it, and
+            // it should take its default
+            size_t count = std::min(values.size(), columns.size());
+            if (count == 0) {
+              return;
+            }
+            std::string sql = "INSERT OR IGNORE INTO " + table + " (";
+            for (size_t i = 0; i < count; i++) {
+              sql += (i > 0 ? ", " : "") + columns[i];
+            }
+            sql += ") VALUES (?";
+            for (size_t i = 1; i < count; i++) {
+              sql += ", ?";
+            }
+            sql += ")";
+            Statement& insert = salvaged.prepare(sql);
+            for (size_t i = 0; i < count; i++) {
+              const BtreeReader::Value& value = values[i];
+              if (i == rowid_column) {
+                insert.bind(i + 1, rowid);
+                continue;
+              }
+              switch (value.type) {
+                case BtreeReader::Value::NUL:
+                  insert.bind_null(i + 1);
+                  break;
+                case BtreeReader::Value::INTEGER:
+                  insert.bind(i + 1, value.integer);
+                  break;
+                case BtreeReader::Value::REAL:
+                  insert.bind_real(i + 1, value.real);
+                  break;
+                case BtreeReader::Value::TEXT:
+                  insert.bind(i + 1, value.bytes);
+                  break;
+                case BtreeReader::Value::BLOB:
+                  insert.bind_blob(i + 1, value.bytes);
+                  break;
+              }
+            }
+            // Rows breaking a constraint (most likely from damage) are
+            // ignored
+            insert.step();
+            rows += sqlite3_changes(salvaged.handle);
+          }
+      );
+      salvaged.query("COMMIT").step();
+    }
+
+    // The checks' lookups rely on the same indexes as on the real thing
+    for (const BtreeReader::SchemaEntry& entry : schema) {
+      if (entry.type != "index" || entry.sql.empty() ||
+          std::find(copied.begin(), copied.end(), entry.table) ==
+              copied.end()) {
+        continue;
+      }
+      try {
+        salvaged.query(entry.sql).step();
+      } catch (std::runtime_error&) {
+        // e.g. a unique index that damaged rows don't satisfy
+      }
+    }
+  } catch (...) {
+    std::filesystem::remove(db_path);
+    throw;
+  }
+  damaged_pages = reader.damaged_pages();
+}
+
+SalvagedMetadata::~SalvagedMetadata() {
+  std::error_code ec;
+  std::filesystem::remove(db_path, ec);
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ *
+ * - - -
+ *
+ * Salvage
+ * Once the metadata database is damaged, SQLite gives up on any query that
+ * touches a damaged page, so nothing can be checked. BtreeReader reads the
+ * rows of a table straight from the b-tree pages of the database file, mapped
+ * into memory, without SQLite. A page that doesn't make sense (a bad page
+ * type, cells or children outside the page or file, or a page reached twice)
+ * is skipped, along with anything below it, and the rest are still read.
+ *
+ * SalvagedMetadata uses this to copy the rows that can still be read from the
+ * tables the checks need into a temporary database, so that they can be run
+ * against that instead. Only the main database file is read, so changes still
+ * in the WAL are missed.
+ *
+ * The file format is described at https://www.sqlite.org/fileformat.html
+ */
+
+#ifndef FSCK_SFS_SRC_SALVAGE_H__
+#define FSCK_SFS_SRC_SALVAGE_H__
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class BtreeReader {
+ public:
+  struct Value {
+    enum Type { NUL, INTEGER, REAL, TEXT, BLOB } type;
+    int64_t integer;
+    double real;
+    std::string_view bytes;  // TEXT or BLOB
+  };
+  // Called for each row of a table. The values are only valid for the
+  // duration of the call.
+  using RowHandler =
+      std::function<void(int64_t rowid, const std::vector<Value>& values)>;
+  struct SchemaEntry {
+    std::string type;  // "table" or "index"
+    std::string name;
+    std::string table;
+    uint32_t root;
+    std::string sql;
+  };
+
+ private:
+  int fd;
+  const unsigned char* data;
+  size_t size;
+  uint32_t page_size;
+  uint32_t usable_size;
+  uint32_t page_count;
+  std::vector<bool> visited;
+  uint64_t damaged;
+
+  const unsigned char* page(uint32_t number) const;
+  void scan_page(uint32_t number, unsigned depth, const RowHandler& handler);
+  bool read_cell(
+      const unsigned char* cell, const unsigned char* page_end,
+      std::string& overflow, std::vector<Value>& values,
+      const RowHandler& handler
+  );
+
+ public:
+  // Throws std::runtime_error if path can't be read, or isn't an SQLite
+  // database at all
+  BtreeReader(const std::filesystem::path& path);
+  BtreeReader(const BtreeReader&) = delete;
+  BtreeReader& operator=(const BtreeReader&) = delete;
+  ~BtreeReader();
+
+  // The entries of the schema table that can be read
+  std::vector<SchemaEntry> schema();
+  // Calls handler for every row that can be read of the table whose b-tree
+  // starts at root
+  void scan(uint32_t root, const RowHandler& handler);
+  // Pages skipped so far because they were damaged
+  uint64_t damaged_pages() const { return damaged; }
+};
+
+class SalvagedMetadata {
+ private:
+  std::filesystem::path db_path;
+
+ public:
+  uint64_t rows;
+  uint64_t damaged_pages;
+  // Tables that couldn't be found in the schema
+  std::vector<std::string> missing;
+
+  // Copies the readable rows of tables from the database at damaged into a
+  // new temporary database
+  SalvagedMetadata(
+      const std::filesystem::path& damaged,
+      const std::vector<std::string>& tables
+  );
+  SalvagedMetadata(const SalvagedMetadata&) = delete;
+  SalvagedMetadata& operator=(const SalvagedMetadata&) = delete;
+  // Removes the temporary database
+  ~SalvagedMetadata();
+
+  const std::filesystem::path& path() const { return db_path; }
+};
+
+#endif  // FSCK_SFS_SRC_SALVAGE_H__
@@ -0,0 +1,107 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ */
+
+#include "serialize.h"
+
+#include <istream>
+#include <stdexcept>
+#include <string>
+
+void Encoder::put_varint(uint64_t value) {
+  while (value >= 0x80) {
+    put_u8(static_cast<uint8_t>(value | 0x80));
+    value >>= 7;
+  }
+  put_u8(static_cast<uint8_t>(value));
+}
+
+void Encoder::put_string(const std::string& value) {
+  put_varint(value.size());
+  buf.append(value);
+}
+
+uint8_t Decoder::get_u8() {
+  if (pos == end) {
+    throw std::runtime_error("truncated record");
+  }
+  return static_cast<uint8_t>(*pos++);
+}
+
+uint64_t Decoder::get_varint() {
+  uint64_t value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    uint8_t byte = get_u8();
+    value |= uint64_t(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return value;
+    }
+  }
+  throw std::runtime_error("malformed varint in record");
+}
+
+std::string Decoder::get_string() {
+  uint64_t length = get_varint();
+  if (length > uint64_t(end - pos)) {
+    throw std::runtime_error("truncated record");
+  }
+  std::string value(pos, length);
+  pos += length;
+  return value;
+}
+
+constexpr uint32_t MAX_FRAME_SIZE = 64 * 1024 * 1024;
+
+// FNV-1a - not cryptographic, but plenty to spot a torn write
+static uint32_t checksum(const std::string& data) {
+  uint32_t hash = 2166136261u;
+  for (unsigned char c : data) {
+    hash = (hash ^ c) * 16777619u;
+  }
+  return hash;
+}
+
+static void put_u32(std::string& out, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    out.push_back(static_cast<char>(value >> (i * 8)));
+  }
+}
+
+static uint32_t get_u32(const char* in) {
+  uint32_t value = 0;
+  for (int i = 0; i < 4; i++) {
+    value |= uint32_t(static_cast<unsigned char>(in[i])) << (i * 8);
+  }
+  return value;
+}
+
+std::string frame(const std::string& payload) {
+  std::string out;
+  out.reserve(payload.size() + 8);
+  put_u32(out, payload.size());
+  put_u32(out, checksum(payload));
+  out.append(payload);
+  return out;
+}
+
+bool read_frame(std::istream& in, std::string& payload) {
+  char header[8];
+  if (!in.read(header, sizeof(header))) {
+    return false;
+  }
+  uint32_t length = get_u32(header);
+  if (length > MAX_FRAME_SIZE) {
+    // Most likely a torn header; don't try to allocate whatever it says
+    return false;
+  }
+  payload.resize(length);
+  if (!in.read(payload.data(), payload.size())) {
+    return false;
+  }
+  return checksum(payload) == get_u32(header + 4);
+}
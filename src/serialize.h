@@ -0,0 +1,57 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ *
+ * - - -
+ *
+ * Helpers for the compact binary records fsck.sfs writes to disk. Integers
+ * are written as LEB128 varints and strings are length prefixed. Records are
+ * stored in frames, each with a length and checksum, so a reader can detect
+ * a frame that was only partially written when fsck was interrupted.
+ */
+
+#ifndef FSCK_SFS_SRC_SERIALIZE_H__
+#define FSCK_SFS_SRC_SERIALIZE_H__
+
+#include <cstdint>
+#include <istream>
+#include <string>
+
+class Encoder {
+ private:
+  std::string buf;
+
+ public:
+  void put_u8(uint8_t value) { buf.push_back(static_cast<char>(value)); }
+  void put_varint(uint64_t value);
+  void put_string(const std::string& value);
+  const std::string& data() const { return buf; }
+  void clear() { buf.clear(); }
+};
+
+class Decoder {
+ private:
+  const char* pos;
+  const char* end;
+
+ public:
+  Decoder(const std::string& data)
+      : pos(data.data()), end(data.data() + data.size()) {}
+  uint8_t get_u8();
+  uint64_t get_varint();
+  std::string get_string();
+  bool at_end() const { return pos == end; }
+};
+
+// Wraps payload in a frame: 32 bit length, 32 bit checksum, then payload
+std::string frame(const std::string& payload);
+
+// Reads the next complete, intact frame from in. Returns false at the end of
+// the stream, or on reaching a truncated or corrupt frame.
+bool read_frame(std::istream& in, std::string& payload);
+
+#endif  // FSCK_SFS_SRC_SERIALIZE_H__
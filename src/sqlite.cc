@@ -13,19 +13,121 @@
 
 #include <filesystem>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
 
-Database::Database(const std::filesystem::path& _db)
-    : db(_db), handle(nullptr) {
-  int rc = sqlite3_open(db.string().c_str(), &handle);
+constexpr int BUSY_TIMEOUT_MS = 10000;
+
+/* Read-only connections to a WAL mode database create its -wal and -shm files
+ * if they're missing, but can't remove them again on closing, as that takes a
+ * checkpoint. Left behind, they'd make the database look like it wasn't shut
+ * down cleanly. So for each database, count the read-only connections open
+ * in this process, and note whether the WAL was missing when the first of
+ * them opened.
+ */
+struct ReadOnlyUse {
+  unsigned connections = 0;
+  bool created_wal = false;
+};
+static std::mutex read_only_mutex;
+static std::map<std::filesystem::path, ReadOnlyUse> read_only_uses;
+
+/* Remove Empty WAL - Has SQLite remove a WAL (and its shared memory file)
+ * left empty by read-only connections, by closing a read-write connection,
+ * as s3gw would have. SQLite only does so if it's the last connection to the
+ * database in any process, and checkpointing an empty WAL doesn't write to
+ * the database, so this leaves both as they were before we opened them.
+ */
+static void remove_empty_wal(const std::filesystem::path& db) {
+  std::error_code ec;
+  std::filesystem::path wal(db.string() + "-wal");
+  if (std::filesystem::file_size(wal, ec) != 0 || ec) {
+    return;
+  }
+  sqlite3* handle = nullptr;
+  if (sqlite3_open_v2(
+          db.string().c_str(), &handle, SQLITE_OPEN_READWRITE, nullptr
+      ) == SQLITE_OK) {
+    // The WAL is only opened once the database is read
+    sqlite3_exec(
+        handle, "SELECT COUNT(*) FROM sqlite_master", nullptr, nullptr,
+        nullptr
+    );
+  }
+  sqlite3_close(handle);
+}
+
+Database::Database(const std::filesystem::path& _db, bool _read_only)
+    : db(_db), read_only(_read_only), handle(nullptr) {
+  int flags = read_only ? SQLITE_OPEN_READONLY
+                        : SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+  if (read_only) {
+    std::lock_guard<std::mutex> lock(read_only_mutex);
+    ReadOnlyUse& use = read_only_uses[db];
+    if (use.connections++ == 0) {
+      use.created_wal = !std::filesystem::exists(db.string() + "-wal");
+    }
+  }
+  int rc = sqlite3_open_v2(db.string().c_str(), &handle, flags, nullptr);
   if (rc != SQLITE_OK) {
-    const char* err = sqlite3_errmsg(handle);
-    sqlite3_close(handle);
+    std::string err(sqlite3_errmsg(handle));
+    close();
     throw std::runtime_error(err);
   }
+  // Fixes may be applied from several connections at once
+  sqlite3_busy_timeout(handle, BUSY_TIMEOUT_MS);
 }
 
 Database::~Database() {
+  // Statements must be finalized before the database can be closed
+  statements.clear();
+  close();
+}
+
+void Database::close() {
   sqlite3_close(handle);
+  if (!read_only) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(read_only_mutex);
+  auto use = read_only_uses.find(db);
+  if (--use->second.connections == 0) {
+    if (use->second.created_wal) {
+      remove_empty_wal(db);
+    }
+    read_only_uses.erase(use);
+  }
+}
+
+Statement& Database::prepare(const std::string& query) {
+  std::unique_ptr<Statement>& stm = statements[query];
+  if (stm) {
+    stm->reset();
+  } else {
+    stm = std::make_unique<Statement>(handle, query);
+    if (record_plans) {
+      std::vector<std::string> plan = explain(query);
+      // Statements like BEGIN have no plan worth reporting
+      if (!plan.empty()) {
+        plans.emplace_back(query, std::move(plan));
+      }
+    }
+  }
+  return *stm;
+}
+
+std::vector<std::string> Database::explain(const std::string& query) {
+  Statement stm(handle, "EXPLAIN QUERY PLAN " + query);
+  // Each step gives its own id and its parent's, which is 0 at the top
+  std::map<int64_t, size_t> depth;
+  std::vector<std::string> plan;
+  for (Row row : stm) {
+    size_t d = depth[row.int64(1)];
+    depth[row.int64(0)] = d + 1;
+    plan.push_back(std::string(d * 2, ' ') + std::string(row.text(3)));
+  }
+  return plan;
 }
 
 /* Count in Table - Count number of rows in named table where the condition
@@ -35,15 +137,8 @@ Database::~Database() {
  */
 int Database::count_in_table(
     const std::string& table, const std::string& condition
-) const {
-  std::string query =
-      "SELECT COUNT(*) FROM " + table + " WHERE " + condition + ";";
-  Statement stm(handle, query);
-  int count = 0;
-  if (sqlite3_step(stm) == SQLITE_ROW && sqlite3_column_count(stm) > 0) {
-    count = sqlite3_column_int(stm, 0);
-  }
-  return count;
+) {
+  return count("SELECT COUNT(*) FROM " + table + " WHERE " + condition + ";");
 }
 
 // TODO: delete this, it's not used anywhere
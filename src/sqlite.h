@@ -16,39 +16,202 @@
 
 #include <sqlite3.h>
 
+#include <cstdint>
 #include <filesystem>
+#include <memory>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "trace.h"
+
+// Steps of a statement less than this far apart (in nanoseconds) are traced
+// as one span
+constexpr int64_t SQL_TRACE_GAP = 100000;
+
+/* Row - The current result row of a Statement. Text columns are returned as
+ * views of SQLite's own buffer, which are only valid until the statement is
+ * stepped again.
+ */
+class Row {
+ private:
+  sqlite3_stmt* stmt;
+
+ public:
+  Row(sqlite3_stmt* s) : stmt(s) {}
+  bool is_null(int column) const {
+    return sqlite3_column_type(stmt, column) == SQLITE_NULL;
+  }
+  int64_t int64(int column) const { return sqlite3_column_int64(stmt, column); }
+  std::string_view text(int column) const {
+    const char* text =
+        reinterpret_cast<const char*>(sqlite3_column_text(stmt, column));
+    return text ? std::string_view(text, sqlite3_column_bytes(stmt, column))
+                : std::string_view();
+  }
+};
+
 class Statement {
  private:
+  sqlite3* db;
   sqlite3_stmt* stmt;
+  // When tracing, the time the current span of stepping began, otherwise
+  // zero, and when the last step in it ended
+  int64_t trace_start;
+  int64_t trace_end;
+
+  void end_trace() {
+    if (trace_start != 0) {
+      Trace::record("sql", sqlite3_sql(stmt), trace_start, trace_end);
+      trace_start = 0;
+    }
+  }
+
+  void check(int rc) {
+    if (rc != SQLITE_OK) {
+      throw std::runtime_error(sqlite3_errmsg(db));
+    }
+  }
 
  public:
   Statement() = delete;
   Statement(const Statement&) = delete;
   Statement& operator=(const Statement&) = delete;
-  Statement(sqlite3* db, const std::string& query) : stmt(nullptr) {
-    if (sqlite3_prepare_v2(db, query.c_str(), query.length(), &stmt, nullptr) !=
-        SQLITE_OK) {
-      throw std::runtime_error(sqlite3_errmsg(db));
-    }
+  Statement(sqlite3* _db, const std::string& query)
+      : db(_db), stmt(nullptr), trace_start(0), trace_end(0) {
+    check(sqlite3_prepare_v2(db, query.c_str(), query.length(), &stmt, nullptr)
+    );
   };
   virtual ~Statement() { sqlite3_finalize(stmt); };
   operator sqlite3_stmt*() { return stmt; }
+
+  // Parameters are numbered from 1, as in SQLite
+  void bind(int index, int64_t value) {
+    check(sqlite3_bind_int64(stmt, index, value));
+  }
+  void bind(int index, std::string_view value) {
+    check(sqlite3_bind_text(
+        stmt, index, value.data(), value.size(), SQLITE_TRANSIENT
+    ));
+  }
+  void bind_real(int index, double value) {
+    check(sqlite3_bind_double(stmt, index, value));
+  }
+  void bind_blob(int index, std::string_view value) {
+    check(sqlite3_bind_blob(
+        stmt, index, value.data(), value.size(), SQLITE_TRANSIENT
+    ));
+  }
+  void bind_null(int index) { check(sqlite3_bind_null(stmt, index)); }
+  template <typename... Args>
+  void bind_all(const Args&... args) {
+    int index = 1;
+    (bind(index++, args), ...);
+  }
+
+  // Returns true if there's a row to read, false when done. When tracing,
+  // steps following on from each other are traced as one span, which ends
+  // when the caller spends a while between steps (e.g. waiting on IO for the
+  // row it has), so that isn't blamed on SQLite.
+  bool step() {
+    int64_t start = Trace::enabled() ? Trace::now() : 0;
+    if (start != 0) {
+      if (trace_start != 0 && start - trace_end > SQL_TRACE_GAP) {
+        end_trace();
+      }
+      if (trace_start == 0) {
+        trace_start = start;
+      }
+    }
+    int rc = sqlite3_step(stmt);
+    if (start != 0) {
+      trace_end = Trace::now();
+    }
+    if (rc == SQLITE_ROW) {
+      return true;
+    }
+    end_trace();
+    if (rc == SQLITE_DONE) {
+      return false;
+    }
+    throw std::runtime_error(sqlite3_errmsg(db));
+  }
+  void reset() {
+    end_trace();
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+  }
+  Row row() const { return Row(stmt); }
+
+  // Allows iterating over the remaining result rows with a range-based for
+  class iterator {
+   private:
+    Statement* statement;
+
+   public:
+    iterator(Statement* s) : statement(s) {}
+    Row operator*() const { return statement->row(); }
+    iterator& operator++() {
+      if (!statement->step()) {
+        statement = nullptr;
+      }
+      return *this;
+    }
+    bool operator!=(const iterator& other) const {
+      return statement != other.statement;
+    }
+  };
+  iterator begin() { return step() ? iterator(this) : end(); }
+  iterator end() { return iterator(nullptr); }
 };
 
 class Database {
  private:
-  const std::filesystem::path& db;
+  const std::filesystem::path db;
+  const bool read_only;
+  // Prepared statements, keyed by their SQL
+  std::unordered_map<std::string, std::unique_ptr<Statement>> statements;
+
+  void close();
 
  public:
   sqlite3* handle;
-  Database(const std::filesystem::path& _db);
+  Database(const std::filesystem::path& _db, bool read_only = false);
   ~Database();
 
-  int count_in_table(const std::string& table, const std::string& condition)
-      const;
+  // Returns a cached prepared statement for query, reset and with the given
+  // parameters bound. The statement belongs to the database, and is reused
+  // by the next call with the same query, so only one caller can be stepping
+  // through it at a time.
+  template <typename... Args>
+  Statement& query(const std::string& query, const Args&... args) {
+    Statement& stm = prepare(query);
+    stm.bind_all(args...);
+    return stm;
+  }
+  Statement& prepare(const std::string& query);
+
+  // Runs a "SELECT COUNT(...)" style query and returns the count
+  template <typename... Args>
+  int64_t count(const std::string& query, const Args&... args) {
+    Statement& stm = this->query(query, args...);
+    int64_t count = stm.step() ? stm.row().int64(0) : 0;
+    stm.reset();
+    return count;
+  }
+
+  // Returns the plan SQLite would use for query, one line per step, indented
+  // to show nesting
+  std::vector<std::string> explain(const std::string& query);
+  // If set, queries are explained as they're first prepared, and their plans
+  // kept in plans, so they can be reported
+  bool record_plans = false;
+  std::vector<std::pair<std::string, std::vector<std::string>>> plans;
+
+  int count_in_table(const std::string& table, const std::string& condition);
   //std::vector<std::string> select_from_table(
   //    const std::string& table, const std::string& column
   //) const;
@@ -0,0 +1,197 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ */
+
+#include "stat_pipeline.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <filesystem>
+#include <stdexcept>
+#include <utility>
+
+static int64_t steady_now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch()
+  )
+      .count();
+}
+
+StatPipeline::StatPipeline(
+    unsigned queue_depth, std::shared_ptr<IoThrottle> _throttle,
+    bool _adaptive
+)
+    : slots(std::max(queue_depth, 1u)), throttle(std::move(_throttle)) {
+  if (_adaptive) {
+    adaptive = std::make_unique<AdaptiveLimit>(slots.size());
+  }
+  for (unsigned i = slots.size(); i > 0; i--) {
+    free_slots.push_back(i - 1);
+  }
+  try {
+    ring = std::make_unique<IoUring>(slots.size());
+    if (!ring->supports(IORING_OP_STATX)) {
+      ring.reset();
+    }
+  } catch (std::runtime_error&) {
+    // Fall back to the thread pool
+  }
+  if (!ring) {
+    pool = std::make_unique<ThreadPool>(slots.size(), slots.size());
+  }
+}
+
+StatPipeline::~StatPipeline() {
+  // Nothing can be freed while the kernel or a pool thread might still be
+  // writing to it
+  try {
+    while (in_flight() > 0) {
+      wait(false);
+    }
+  } catch (std::runtime_error&) {
+    // Only possible with io_uring, and closing the ring cancels what's left
+  }
+}
+
+void StatPipeline::start(unsigned slot) {
+  Slot& s = slots[slot];
+  if (ring) {
+    // There's always room, as there are never more requests in flight than
+    // there are slots, and the ring has at least that many entries
+    io_uring_sqe* sqe = ring->get_sqe();
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = reinterpret_cast<uint64_t>(s.path.c_str());
+    sqe->len = STATX_BASIC_STATS;
+    sqe->off = reinterpret_cast<uint64_t>(&s.result.stx);
+    sqe->user_data = slot;
+    // Not submitted until the queue is full, or drain() is called
+    unsubmitted.push_back(slot);
+  } else {
+    pool->submit([this, slot] {
+      Slot& s = slots[slot];
+      // Timed here rather than by the caller, who may be busy handling
+      // other results
+      if (adaptive) {
+        s.started = steady_now();
+      }
+      s.result.error =
+          statx(AT_FDCWD, s.path.c_str(), 0, STATX_BASIC_STATS, &s.result.stx)
+              ? errno
+              : 0;
+      if (adaptive) {
+        s.finished = steady_now();
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        completed.push_back(slot);
+      }
+      completion.notify_one();
+    });
+  }
+}
+
+void StatPipeline::finish(unsigned slot, bool handle) {
+  Handler handler = std::move(slots[slot].handler);
+  Result result = slots[slot].result;
+  if (adaptive && slots[slot].finished != 0) {
+    adaptive->completed(
+        slots[slot].finished - slots[slot].started, slots[slot].finished
+    );
+  }
+  // Free the slot first, in case of exceptions
+  free_slots.push_back(slot);
+  if (throttle) {
+    throttle->release();
+  }
+  if (!handle) {
+    return;
+  }
+  if (result.error != 0 && result.error != ENOENT && result.error != ENOTDIR) {
+    throw std::filesystem::filesystem_error(
+        "statx", slots[slot].path,
+        std::error_code(result.error, std::generic_category())
+    );
+  }
+  handler(result);
+}
+
+void StatPipeline::wait(bool handle) {
+  if (ring) {
+    // Only the time the kernel has requests counts as their latency, not
+    // the time spent queueing more, or handling earlier results. So
+    // requests are timed from when they're submitted, and those reaped
+    // together after waiting are taken to have completed when the wait
+    // ended. Those which completed while we were busy elsewhere are reaped
+    // first, without a time, as when they completed isn't known.
+    auto reaper = [this, handle](int64_t now) {
+      return [this, handle, now](const io_uring_cqe& cqe) {
+        unsigned slot = cqe.user_data;
+        slots[slot].result.error = cqe.res < 0 ? -cqe.res : 0;
+        slots[slot].finished = now;
+        finish(slot, handle);
+      };
+    };
+    unsigned reaped = ring->reap(reaper(0));
+    if (reaped > 0 && unsubmitted.empty()) {
+      return;
+    }
+    int64_t now = adaptive ? steady_now() : 0;
+    for (unsigned slot : unsubmitted) {
+      slots[slot].started = now;
+    }
+    unsubmitted.clear();
+    ring->submit(reaped > 0 ? 0 : 1);
+    if (reaped == 0) {
+      ring->reap(reaper(adaptive ? steady_now() : 0));
+    }
+  } else {
+    std::unique_lock<std::mutex> lock(mutex);
+    completion.wait(lock, [this] { return !completed.empty(); });
+    while (!completed.empty()) {
+      unsigned slot = completed.back();
+      completed.pop_back();
+      lock.unlock();
+      finish(slot, handle);
+      lock.lock();
+    }
+  }
+}
+
+void StatPipeline::submit(const std::string& path, Handler handler) {
+  while (free_slots.empty() ||
+         (adaptive && in_flight() >= adaptive->limit())) {
+    wait();
+  }
+  if (throttle) {
+    // Only we can complete our requests in flight, so rather than blocking
+    // while holding their tokens, complete some of them
+    while (!throttle->try_acquire()) {
+      if (in_flight() == 0) {
+        throttle->acquire();
+        break;
+      }
+      wait();
+    }
+  }
+  unsigned slot = free_slots.back();
+  free_slots.pop_back();
+  slots[slot].path = path;
+  slots[slot].handler = std::move(handler);
+  start(slot);
+}
+
+void StatPipeline::drain() {
+  while (in_flight() > 0) {
+    wait();
+  }
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ *
+ * - - -
+ *
+ * Stat Pipeline
+ * Checks driven by the metadata need to stat every object it lists. Doing
+ * that one file at a time makes them latency bound on network backed
+ * volumes, so this keeps up to queue_depth statx() calls in flight at once,
+ * through io_uring if available, or a pool of threads if not. If given an
+ * IoThrottle, the calls in flight also count towards its limit. If adaptive,
+ * queue_depth is only the most that may be in flight, and the number actually
+ * kept in flight is tuned as we go (see adaptive_limit.h).
+ *
+ * Results are handed to the handler given to submit(), always on the thread
+ * calling submit() or drain(), so handlers needn't worry about locking. As
+ * with std::filesystem::exists(), errors other than the file not existing
+ * are thrown (as std::filesystem::filesystem_error) rather than handled.
+ */
+
+#ifndef FSCK_SFS_SRC_STAT_PIPELINE_H__
+#define FSCK_SFS_SRC_STAT_PIPELINE_H__
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "adaptive_limit.h"
+#include "io_throttle.h"
+#include "thread_pool.h"
+#include "uring.h"
+
+constexpr unsigned DEFAULT_QUEUE_DEPTH = 64;
+
+class StatPipeline {
+ public:
+  struct Result {
+    int error;  // 0, ENOENT or ENOTDIR
+    struct statx stx;
+    bool is_regular_file() const {
+      return error == 0 && S_ISREG(stx.stx_mode);
+    }
+  };
+  using Handler = std::function<void(const Result&)>;
+
+ private:
+  struct Slot {
+    std::string path;
+    Result result;
+    Handler handler;
+    // When the request was submitted and completed, on the steady clock in
+    // nanoseconds, if adaptive. Zero if it's not known when it completed.
+    int64_t started;
+    int64_t finished;
+  };
+  // Slots are written to by the kernel or pool threads while in flight, so
+  // must outlive both
+  std::vector<Slot> slots;
+  std::vector<unsigned> free_slots;
+  std::unique_ptr<IoUring> ring;
+  // Shared with other pipelines, if any
+  std::shared_ptr<IoThrottle> throttle;
+  std::unique_ptr<AdaptiveLimit> adaptive;
+  // Requests queued in the ring but not yet submitted to the kernel
+  std::vector<unsigned> unsubmitted;
+  // Completed slots, when using the thread pool
+  std::vector<unsigned> completed;
+  std::mutex mutex;
+  std::condition_variable completion;
+  // Declared last, so its threads are gone before anything they use
+  std::unique_ptr<ThreadPool> pool;
+
+  void start(unsigned slot);
+  void finish(unsigned slot, bool handle);
+  // Waits for at least one in flight request to complete, then finishes
+  // every request that has
+  void wait(bool handle = true);
+  unsigned in_flight() const { return slots.size() - free_slots.size(); }
+
+ public:
+  StatPipeline(
+      unsigned queue_depth = DEFAULT_QUEUE_DEPTH,
+      std::shared_ptr<IoThrottle> throttle = nullptr, bool adaptive = false
+  );
+  StatPipeline(const StatPipeline&) = delete;
+  StatPipeline& operator=(const StatPipeline&) = delete;
+  ~StatPipeline();
+
+  bool using_io_uring() const { return ring != nullptr; }
+  // The tuning done, if adaptive, otherwise null
+  const AdaptiveLimit* adaptive_limit() const { return adaptive.get(); }
+  void submit(const std::string& path, Handler handler);
+  // Waits for everything submitted to complete
+  void drain();
+};
+
+#endif  // FSCK_SFS_SRC_STAT_PIPELINE_H__
@@ -0,0 +1,56 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ *
+ * - - -
+ *
+ * A fixed size pool of worker threads with a bounded task queue. submit()
+ * blocks while the queue is full, so a producer streaming work from disk
+ * never gets far ahead of the workers.
+ */
+
+#ifndef FSCK_SFS_SRC_THREAD_POOL_H__
+#define FSCK_SFS_SRC_THREAD_POOL_H__
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+ private:
+  std::vector<std::thread> workers;
+  std::deque<std::function<void()>> queue;
+  std::mutex mutex;
+  std::condition_variable work_available;
+  std::condition_variable space_available;
+  std::condition_variable idle;
+  const size_t max_queued;
+  size_t active;
+  bool stopping;
+  std::exception_ptr error;
+
+  void run();
+
+ public:
+  // threads = 0 means one per CPU
+  ThreadPool(unsigned threads = 0, size_t max_queued = 64);
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+  ~ThreadPool();
+
+  void submit(std::function<void()> task);
+  // Waits for all submitted tasks to finish. Rethrows the first exception
+  // thrown by any of them.
+  void wait();
+  size_t size() const { return workers.size(); }
+};
+
+#endif  // FSCK_SFS_SRC_THREAD_POOL_H__
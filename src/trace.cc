@@ -0,0 +1,135 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ */
+
+#include "trace.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+struct TraceEvent {
+  const char* name;
+  std::string detail;
+  int64_t start;
+  int64_t end;
+};
+
+/* Trace Buffer - The spans recorded by one thread. Once full, the oldest
+ * spans are overwritten. Buffers are never freed, so spans recorded by
+ * threads which have since exited can still be written.
+ */
+struct TraceBuffer {
+  unsigned tid;
+  std::vector<TraceEvent> events;
+  size_t recorded = 0;
+};
+
+static std::mutex registry_mutex;
+static std::vector<std::unique_ptr<TraceBuffer>> buffers;
+static int64_t origin = 0;
+static thread_local TraceBuffer* local_buffer = nullptr;
+
+void Trace::start() {
+  origin = now();
+  active.store(true, std::memory_order_relaxed);
+}
+
+int64_t Trace::now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch()
+         )
+             .count() +
+         1;
+}
+
+void Trace::record(const char* name, std::string_view detail, int64_t start) {
+  record(name, detail, start, now());
+}
+
+void Trace::record(
+    const char* name, std::string_view detail, int64_t start, int64_t end
+) {
+  if (local_buffer == nullptr) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    buffers.emplace_back(std::make_unique<TraceBuffer>());
+    local_buffer = buffers.back().get();
+    local_buffer->tid = buffers.size();
+  }
+  TraceEvent event{name, std::string(detail), start, end};
+  if (local_buffer->events.size() < TRACE_BUFFER_SIZE) {
+    local_buffer->events.emplace_back(std::move(event));
+  } else {
+    local_buffer->events[local_buffer->recorded % TRACE_BUFFER_SIZE] =
+        std::move(event);
+  }
+  local_buffer->recorded++;
+}
+
+/* Escape - Quotes str as a JSON string.
+ */
+static std::string escape(std::string_view str) {
+  std::string out("\"");
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out += buf;
+    } else {
+      out += c;
+    }
+  }
+  return out + "\"";
+}
+
+/* Microseconds - Formats a time in nanoseconds as microseconds, which is
+ * what the trace event format uses.
+ */
+static std::string microseconds(int64_t ns) {
+  char buf[32];
+  snprintf(
+      buf, sizeof(buf), "%lld.%03lld", static_cast<long long>(ns / 1000),
+      static_cast<long long>(ns % 1000)
+  );
+  return buf;
+}
+
+void Trace::write(const std::filesystem::path& path) {
+  std::ofstream out(path);
+  if (!out) {
+    throw std::runtime_error("Unable to write trace to " + path.string());
+  }
+  out << "{\"traceEvents\":[";
+  bool first = true;
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  for (const auto& buffer : buffers) {
+    for (const TraceEvent& event : buffer->events) {
+      out << (first ? "\n" : ",\n") << "{\"name\":" << escape(event.name)
+          << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->tid
+          << ",\"ts\":" << microseconds(event.start - origin)
+          << ",\"dur\":" << microseconds(event.end - event.start);
+      if (!event.detail.empty()) {
+        out << ",\"args\":{\"detail\":" << escape(event.detail) << "}";
+      }
+      out << "}";
+      first = false;
+    }
+  }
+  out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+  if (!out) {
+    throw std::runtime_error("Unable to write trace to " + path.string());
+  }
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ *
+ * - - -
+ *
+ * Tracing
+ * Records how long checks, fixes, directory visits, SQL statements and object
+ * verifications take, as spans which can be written out in the Chrome trace
+ * event format (and so viewed with chrome://tracing or Perfetto) to see where
+ * a slow run spends its time.
+ *
+ * Each thread records spans to its own ring buffer, which keeps only the most
+ * recent TRACE_BUFFER_SIZE spans. Until Trace::start() is called, creating a
+ * TraceSpan costs no more than checking a flag.
+ */
+
+#ifndef FSCK_SFS_SRC_TRACE_H__
+#define FSCK_SFS_SRC_TRACE_H__
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <string_view>
+
+constexpr size_t TRACE_BUFFER_SIZE = 64 * 1024;
+
+class Trace {
+ private:
+  inline static std::atomic<bool> active = false;
+
+ public:
+  static bool enabled() { return active.load(std::memory_order_relaxed); }
+  // Starts recording spans
+  static void start();
+  // Returns the current time, in nanoseconds (never zero)
+  static int64_t now();
+  // Records a span which began at start and ends now, on the calling thread
+  static void record(const char* name, std::string_view detail, int64_t start);
+  // Records a span which began at start and ended at end
+  static void record(
+      const char* name, std::string_view detail, int64_t start, int64_t end
+  );
+  // Writes every span recorded so far as Chrome trace JSON. No spans may be
+  // in the middle of being recorded.
+  static void write(const std::filesystem::path& path);
+};
+
+/* Trace Span - Records a span from its construction to its destruction. name
+ * must be a string literal, and detail (e.g. a path) must outlive the span;
+ * it's only copied if tracing.
+ */
+class TraceSpan {
+ private:
+  const char* name;
+  std::string_view detail;
+  int64_t start;
+
+ public:
+  TraceSpan(const char* _name, std::string_view _detail = {})
+      : name(_name),
+        detail(_detail),
+        start(Trace::enabled() ? Trace::now() : 0) {}
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+  ~TraceSpan() {
+    if (start != 0) {
+      Trace::record(name, detail, start);
+    }
+  }
+};
+
+#endif  // FSCK_SFS_SRC_TRACE_H__
@@ -0,0 +1,184 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ */
+
+#include "uring.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+static std::runtime_error uring_error(const std::string& what) {
+  return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+// The rings are shared with the kernel, so the indices need acquire/release
+// ordering
+static unsigned load_acquire(const unsigned* p) {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static void store_release(unsigned* p, unsigned v) {
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+template <typename T>
+static T* offset(void* base, uint32_t off) {
+  return reinterpret_cast<T*>(static_cast<char*>(base) + off);
+}
+
+IoUring::IoUring(unsigned _entries)
+    : ring_fd(-1),
+      sq_ring(MAP_FAILED),
+      cq_ring(MAP_FAILED),
+      sqes(static_cast<io_uring_sqe*>(MAP_FAILED)),
+      queued(0) {
+  io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+  ring_fd = syscall(__NR_io_uring_setup, _entries, &params);
+  if (ring_fd < 0) {
+    throw uring_error("io_uring_setup");
+  }
+  entries = params.sq_entries;
+
+  sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+  }
+  sq_ring = mmap(
+      nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      ring_fd, IORING_OFF_SQ_RING
+  );
+  if (sq_ring == MAP_FAILED) {
+    int saved = errno;
+    close(ring_fd);
+    errno = saved;
+    throw uring_error("mmap io_uring");
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_ring = sq_ring;
+  } else {
+    cq_ring = mmap(
+        nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING
+    );
+  }
+  sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+  sqes = static_cast<io_uring_sqe*>(mmap(
+      nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      ring_fd, IORING_OFF_SQES
+  ));
+  if (cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+    int saved = errno;
+    unmap();
+    errno = saved;
+    throw uring_error("mmap io_uring");
+  }
+
+  sq_head = offset<unsigned>(sq_ring, params.sq_off.head);
+  sq_tail = offset<unsigned>(sq_ring, params.sq_off.tail);
+  sq_mask = offset<unsigned>(sq_ring, params.sq_off.ring_mask);
+  sq_array = offset<unsigned>(sq_ring, params.sq_off.array);
+  cq_head = offset<unsigned>(cq_ring, params.cq_off.head);
+  cq_tail = offset<unsigned>(cq_ring, params.cq_off.tail);
+  cq_mask = offset<unsigned>(cq_ring, params.cq_off.ring_mask);
+  cqes = offset<io_uring_cqe>(cq_ring, params.cq_off.cqes);
+}
+
+IoUring::~IoUring() {
+  unmap();
+}
+
+void IoUring::unmap() {
+  if (sqes != MAP_FAILED) {
+    munmap(sqes, sqes_size);
+  }
+  if (cq_ring != MAP_FAILED && cq_ring != sq_ring) {
+    munmap(cq_ring, cq_ring_size);
+  }
+  if (sq_ring != MAP_FAILED) {
+    munmap(sq_ring, sq_ring_size);
+  }
+  if (ring_fd >= 0) {
+    close(ring_fd);
+  }
+  sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+  cq_ring = sq_ring = MAP_FAILED;
+  ring_fd = -1;
+}
+
+bool IoUring::supports(uint8_t opcode) const {
+  const unsigned ops = 256;
+  std::vector<char> buf(
+      sizeof(io_uring_probe) + ops * sizeof(io_uring_probe_op)
+  );
+  io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(buf.data());
+  if (syscall(
+          __NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, ops
+      ) < 0) {
+    // Probing was added in 5.6, along with IORING_OP_STATX
+    return false;
+  }
+  return opcode <= probe->last_op &&
+         (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+}
+
+io_uring_sqe* IoUring::get_sqe() {
+  unsigned tail = *sq_tail + queued;
+  if (tail - load_acquire(sq_head) >= entries) {
+    return nullptr;
+  }
+  unsigned index = tail & *sq_mask;
+  io_uring_sqe* sqe = &sqes[index];
+  std::memset(sqe, 0, sizeof(*sqe));
+  sq_array[index] = index;
+  queued++;
+  return sqe;
+}
+
+void IoUring::submit(unsigned min_complete) {
+  store_release(sq_tail, *sq_tail + queued);
+  queued = 0;
+  // This includes anything the kernel didn't consume last time
+  unsigned to_submit = *sq_tail - load_acquire(sq_head);
+  unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+  while (syscall(
+             __NR_io_uring_enter, ring_fd, to_submit, min_complete, flags,
+             nullptr, 0
+         ) < 0) {
+    if (errno != EINTR) {
+      throw uring_error("io_uring_enter");
+    }
+  }
+}
+
+unsigned IoUring::reap(const std::function<void(const io_uring_cqe&)>& handler
+) {
+  unsigned head = *cq_head;
+  unsigned tail = load_acquire(cq_tail);
+  unsigned count = 0;
+  while (head != tail) {
+    io_uring_cqe cqe = cqes[head & *cq_mask];
+    head++;
+    count++;
+    // Release the entry before calling the handler, so it can't be lost if
+    // the handler throws
+    store_release(cq_head, head);
+    handler(cqe);
+  }
+  return count;
+}
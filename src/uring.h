@@ -0,0 +1,67 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ *
+ * - - -
+ *
+ * A minimal io_uring wrapper, using the kernel interface directly so there's
+ * no dependency on liburing. Only one thread may use a ring at a time.
+ */
+
+#ifndef FSCK_SFS_SRC_URING_H__
+#define FSCK_SFS_SRC_URING_H__
+
+#include <linux/io_uring.h>
+
+#include <cstdint>
+#include <functional>
+
+class IoUring {
+ private:
+  int ring_fd;
+  unsigned entries;
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;
+  size_t cq_ring_size;
+  io_uring_sqe* sqes;
+  size_t sqes_size;
+
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  io_uring_cqe* cqes;
+
+  // Entries filled in by get_sqe() but not yet made visible to the kernel
+  unsigned queued;
+
+  void unmap();
+
+ public:
+  // Throws std::runtime_error if io_uring is unavailable (old kernel, or
+  // blocked by seccomp as in some container runtimes)
+  IoUring(unsigned entries);
+  IoUring(const IoUring&) = delete;
+  IoUring& operator=(const IoUring&) = delete;
+  ~IoUring();
+
+  // Whether the kernel supports the given IORING_OP_*
+  bool supports(uint8_t opcode) const;
+
+  // Returns a zeroed submission queue entry, or nullptr if the queue is full
+  io_uring_sqe* get_sqe();
+  // Submits queued entries and waits for at least min_complete completions
+  void submit(unsigned min_complete);
+  // Calls handler for each available completion, returns how many
+  unsigned reap(const std::function<void(const io_uring_cqe&)>& handler);
+};
+
+#endif  // FSCK_SFS_SRC_URING_H__
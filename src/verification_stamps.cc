@@ -0,0 +1,182 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ */
+
+#include "verification_stamps.h"
+
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include <cerrno>
+#include <chrono>
+#include <fstream>
+#include <stdexcept>
+
+#include "checks.h"
+#include "serialize.h"
+
+constexpr std::string_view STAMP_INDEX_MAGIC = "fsck.sfs verified 1";
+constexpr uint8_t STAMP_VERSION = 1;
+
+static int64_t statx_mtime_ns(const struct statx& stx) {
+  return int64_t(stx.stx_mtime.tv_sec) * 1000000000 + stx.stx_mtime.tv_nsec;
+}
+
+VerificationStamps::VerificationStamps(
+    const std::filesystem::path& root, bool _recording
+)
+    : root_path(root), recording(_recording), index_changed(false) {
+  std::ifstream in(root_path / STAMP_INDEX_FILENAME, std::ios::binary);
+  std::string payload;
+  if (!in || !read_frame(in, payload) || payload != STAMP_INDEX_MAGIC) {
+    return;
+  }
+  while (read_frame(in, payload)) {
+    try {
+      Decoder entry(payload);
+      std::string obj_path = entry.get_string();
+      std::optional<Stamp> stamp = decode(entry.get_string());
+      if (stamp) {
+        index[obj_path] = *stamp;
+      }
+    } catch (std::runtime_error&) {
+      // A corrupt entry only means an object gets verified again
+    }
+  }
+}
+
+std::string VerificationStamps::encode(const Stamp& stamp) {
+  Encoder out;
+  out.put_u8(STAMP_VERSION);
+  out.put_varint(stamp.size);
+  out.put_varint(stamp.mtime);
+  out.put_varint(stamp.inode);
+  out.put_string(stamp.checksum);
+  out.put_varint(stamp.verified);
+  return out.data();
+}
+
+std::optional<VerificationStamps::Stamp> VerificationStamps::decode(
+    const std::string& data
+) {
+  try {
+    Decoder in(data);
+    if (in.get_u8() != STAMP_VERSION) {
+      return std::nullopt;
+    }
+    Stamp stamp;
+    stamp.size = in.get_varint();
+    stamp.mtime = in.get_varint();
+    stamp.inode = in.get_varint();
+    stamp.checksum = in.get_string();
+    stamp.verified = in.get_varint();
+    return stamp;
+  } catch (std::runtime_error&) {
+    return std::nullopt;
+  }
+}
+
+std::optional<VerificationStamps::Stamp> VerificationStamps::get(
+    const std::filesystem::path& obj_path
+) {
+  char buf[256];
+  ssize_t n = getxattr(
+      (root_path / obj_path).c_str(), STAMP_XATTR.data(), buf, sizeof(buf)
+  );
+  if (n >= 0) {
+    return decode(std::string(buf, n));
+  }
+  auto entry = index.find(obj_path.string());
+  if (entry != index.end()) {
+    return entry->second;
+  }
+  return std::nullopt;
+}
+
+bool VerificationStamps::is_current(
+    const std::filesystem::path& obj_path, const struct statx& stx,
+    const std::string& checksum, int64_t not_before
+) {
+  std::optional<Stamp> stamp = get(obj_path);
+  return stamp && stamp->verified > not_before && stamp->size == stx.stx_size &&
+         stamp->mtime == statx_mtime_ns(stx) && stamp->inode == stx.stx_ino &&
+         stamp->checksum == checksum;
+}
+
+void VerificationStamps::record(
+    const std::filesystem::path& obj_path, const struct statx& stx,
+    const std::string& checksum
+) {
+  if (!recording) {
+    return;
+  }
+  Stamp stamp{
+      stx.stx_size, statx_mtime_ns(stx), stx.stx_ino, checksum,
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::system_clock::now().time_since_epoch()
+      )
+          .count()};
+  std::string value = encode(stamp);
+  // If the file has been replaced since it was verified, the stamp won't
+  // match its inode number, so it will just be verified again
+  if (setxattr(
+          (root_path / obj_path).c_str(), STAMP_XATTR.data(), value.data(),
+          value.size(), 0
+      ) == 0) {
+    return;
+  }
+  if (errno == ENOTSUP) {
+    index[obj_path.string()] = stamp;
+    index_changed = true;
+  }
+  // Otherwise (e.g. a read only filesystem) the object just won't be stamped,
+  // and will be verified again next time
+}
+
+void VerificationStamps::save() {
+  if (!recording) {
+    return;
+  }
+  // Drop the stamps of objects that have since been deleted
+  for (auto entry = index.begin(); entry != index.end();) {
+    struct stat st;
+    if (lstat((root_path / entry->first).c_str(), &st) != 0 &&
+        errno == ENOENT) {
+      entry = index.erase(entry);
+      index_changed = true;
+    } else {
+      ++entry;
+    }
+  }
+  if (!index_changed) {
+    return;
+  }
+  std::filesystem::path index_path(root_path / STAMP_INDEX_FILENAME);
+  std::filesystem::path tmp_path(index_path.string() + ".tmp");
+  {
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    out << frame(std::string(STAMP_INDEX_MAGIC));
+    for (const auto& [obj_path, stamp] : index) {
+      Encoder entry;
+      entry.put_string(obj_path);
+      entry.put_string(encode(stamp));
+      out << frame(entry.data());
+    }
+    if (!out) {
+      Log::log_verbose("Unable to write " + tmp_path.string());
+      return;
+    }
+  }
+  std::error_code ec;
+  std::filesystem::rename(tmp_path, index_path, ec);
+  if (ec) {
+    Log::log_verbose("Unable to write " + index_path.string());
+    return;
+  }
+  index_changed = false;
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright 2023 SUSE, LLC.
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation. See file LICENSE.
+ *
+ * - - -
+ *
+ * Verification Stamps
+ * Almost all objects never change once written, so re-reading every one of
+ * them on every deep check is mostly wasted IO. Once an object's checksum has
+ * been verified, a stamp is recorded in an extended attribute on the object
+ * file, holding its size, mtime and inode number at the time, the checksum
+ * verified, and when. Later deep checks can skip objects whose stamp still
+ * matches, until the stamp is older than the re-verify interval.
+ *
+ * The ctime isn't recorded, as setting the attribute itself changes it. On
+ * filesystems without support for extended attributes, stamps are kept in an
+ * index file at the root of the store instead, from which the stamps of
+ * objects that no longer exist are dropped whenever it's written.
+ *
+ * Recording stamps writes to every object verified (bumping its ctime), so
+ * is only done by runs allowed to modify the store, i.e. with --fix. Stamps
+ * are used to skip objects by any deep check.
+ */
+
+#ifndef FSCK_SFS_SRC_VERIFICATION_STAMPS_H__
+#define FSCK_SFS_SRC_VERIFICATION_STAMPS_H__
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+constexpr std::string_view STAMP_XATTR = "user.fsck.sfs.verified";
+constexpr std::string_view STAMP_INDEX_FILENAME = "fsck.sfs.verified";
+
+class VerificationStamps {
+ public:
+  struct Stamp {
+    uint64_t size;
+    int64_t mtime;  // nanoseconds since the epoch
+    uint64_t inode;
+    std::string checksum;
+    int64_t verified;  // nanoseconds since the epoch
+  };
+
+ private:
+  const std::filesystem::path& root_path;
+  const bool recording;
+  // Stamps for objects on which extended attributes aren't supported, keyed
+  // by path relative to root_path
+  std::unordered_map<std::string, Stamp> index;
+  bool index_changed;
+
+  static std::string encode(const Stamp& stamp);
+  static std::optional<Stamp> decode(const std::string& data);
+  std::optional<Stamp> get(const std::filesystem::path& obj_path);
+
+ public:
+  // If not recording, record() and save() do nothing
+  VerificationStamps(const std::filesystem::path& root, bool recording);
+
+  // Whether obj_path (relative to the root) was verified to have checksum
+  // after not_before, and is unchanged since according to stx
+  bool is_current(
+      const std::filesystem::path& obj_path, const struct statx& stx,
+      const std::string& checksum, int64_t not_before
+  );
+  // Records that the object at obj_path, which had stat data stx, was just
+  // verified to have checksum
+  void record(
+      const std::filesystem::path& obj_path, const struct statx& stx,
+      const std::string& checksum
+  );
+  // Writes out the index, if any stamps had to be added to it or any of
+  // its objects have gone
+  void save();
+};
+
+#endif  // FSCK_SFS_SRC_VERIFICATION_STAMPS_H__